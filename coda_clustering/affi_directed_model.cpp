@@ -5,600 +5,1527 @@
 #include <cstdio>
 #include <cstdlib>
 #include <algorithm>
+#include <functional>
 #include <random>
 
 const static float min_p = 1e-6f;
 
-affi_directed_model::affi_directed_model(graph_t &g, int cluster_num, size_t thread_num) : parallel_algo(g, thread_num)
+affi_directed_model::affi_directed_model(graph_t &g, int cluster_num, size_t thread_num, bool low_memory, affi_storage storage, bool pin_threads) : parallel_algo(g, thread_num, pin_threads), _kernel(affi_select_kernel(storage, affi_padded_size(cluster_num))), _tile_kernel(affi_select_kernel(storage))
 {
 	_cluster_num = cluster_num;
+	_low_memory = low_memory;
+	_row_size = affi_padded_size(cluster_num);
+	_row_bytes = _row_size * affi_storage_size(storage);
+	_tile_prods = nullptr;
+	set_cluster_tile(_row_size > affi_tile_threshold ? affi_tile_size : 0);
+	_prefetch_distance = 4;
 	int n = _graph.node_num();
 	_background_prob = 1.0f / n;
-	size_t size = (size_t)n * _cluster_num;
-	_affi_out_data = new float[size];
-	_affi_out_tmp_data = new float[size];
-	_affi_out_d_data = new float[size];
-	_affi_in_data = new float[size];
-	_affi_in_tmp_data = new float[size];
-	_affi_in_d_data = new float[size];
-
-	_affi_out = new float*[n];
-	_affi_out_tmp = new float*[n];
+	size_t size = (size_t)n * _row_size, bytes = (size_t)n * _row_bytes;
+	_affi_out_data = affi_alloc_bytes(bytes);
+	_affi_out_d_data = affi_alloc(size);
+	_affi_in_data = affi_alloc_bytes(bytes);
+	if (_low_memory)
+	{
+		_affi_out_tmp_data = nullptr;
+		_affi_in_tmp_data = nullptr;
+		_affi_in_d_data = nullptr;
+	}
+	else
+	{
+		_affi_out_tmp_data = affi_alloc_bytes(bytes);
+		_affi_in_tmp_data = affi_alloc_bytes(bytes);
+		_affi_in_d_data = affi_alloc(size);
+	}
+	parallel_for([this](int node, size_t thread) { _update_node_clear(node); });
+
 	_affi_out_d = new float*[n];
-	_affi_in = new float*[n];
-	_affi_in_tmp = new float*[n];
 	_affi_in_d = new float*[n];
 	
 	for (int i = 0; i < n; ++i)
 	{
-		size_t offset = (size_t)i * _cluster_num;
-		_affi_out[i] = _affi_out_data + offset;
-		_affi_out_tmp[i] = _affi_out_tmp_data + offset;
+		size_t offset = (size_t)i * _row_size;
 		_affi_out_d[i] = _affi_out_d_data + offset;
-		_affi_in[i] = _affi_in_data + offset;
-		_affi_in_tmp[i] = _affi_in_tmp_data + offset;
-		_affi_in_d[i] = _affi_in_d_data + offset;
+		_affi_in_d[i] = (_low_memory ? _affi_out_d_data : _affi_in_d_data) + offset;
 	}
 
-	_affi_sum_out = new float[_cluster_num];
-	_affi_sum_in = new float[_cluster_num];
+	_affi_sum_out = affi_alloc(_row_size);
+	_affi_sum_in = affi_alloc(_row_size);
+	std::fill(_affi_sum_out, _affi_sum_out + _row_size, 0.0f);
+	std::fill(_affi_sum_in, _affi_sum_in + _row_size, 0.0f);
+	_affi_sum_out_part = affi_alloc(_thread_num * _row_size);
+	_affi_sum_in_part = affi_alloc(_thread_num * _row_size);
+	_affi_sum_tmp = affi_alloc(2 * _row_size);
+	_scratch_row = affi_alloc(_thread_num * _row_size);
+	std::fill(_scratch_row, _scratch_row + _thread_num * _row_size, 0.0f);
 
 	_likelihood_buf = new float[n];
 	_likelihood_buf_tmp = new float[n];
-	_conductance_tmp = new float[n];
 
 	_likelihood = 1.0;
+
+	_thread_sum = affi_alloc(_thread_num * affi_row_align);
+	std::fill(_thread_sum, _thread_sum + _thread_num * affi_row_align, 0.0f);
+
+	_edge_prod = nullptr;
+	_in_edge_rank = nullptr;
+	_edge_prod_valid = false;
+	_optimizer = nullptr;
+	_lbfgs_size = 0;
+	_lbfgs_count = 0;
+	_lbfgs_head = 0;
+	_lbfgs_side = -1;
+	_lbfgs_s = _lbfgs_y = nullptr;
+	_lbfgs_rho = _lbfgs_a = nullptr;
+	_lbfgs_x = _lbfgs_g = nullptr;
+	_multi_num = 0;
+	_multi_rows = _multi_buf = nullptr;
+	_multi_sum = _multi_sum_part = nullptr;
 }
 
 affi_directed_model::~affi_directed_model()
 {
-	delete[] _affi_out_data;
-	delete[] _affi_out_tmp_data;
-	delete[] _affi_out_d_data;
-	delete[] _affi_in_data;
-	delete[] _affi_in_tmp_data;
-	delete[] _affi_in_d_data;
+	affi_free(_affi_out_data);
+	affi_free(_affi_out_tmp_data);
+	affi_free(_affi_out_d_data);
+	affi_free(_affi_in_data);
+	affi_free(_affi_in_tmp_data);
+	affi_free(_affi_in_d_data);
 
-	delete[] _affi_out;
-	delete[] _affi_out_tmp;
 	delete[] _affi_out_d;
-	delete[] _affi_in;
-	delete[] _affi_in_tmp;
 	delete[] _affi_in_d;
 
-	delete[] _affi_sum_out;
-	delete[] _affi_sum_in;
+	affi_free(_affi_sum_out);
+	affi_free(_affi_sum_in);
+	affi_free(_affi_sum_out_part);
+	affi_free(_affi_sum_in_part);
+	affi_free(_affi_sum_tmp);
+	affi_free(_scratch_row);
 	delete[] _likelihood_buf;
 	delete[] _likelihood_buf_tmp;
-	delete[] _conductance_tmp;
+	affi_free(_thread_sum);
+	delete[] _edge_prod;
+	delete[] _in_edge_rank;
+	delete[] _tile_prods;
+	_free_lbfgs();
+	_free_multi_alpha();
+}
+
+// The edge products of the last likelihood pass, and the rank of every
+// in-edge among the out-edges of its source, let the gradient passes skip
+// the dot products. 8 bytes per edge, so only the line searches of the full
+// model allocate them, on first use.
+void affi_directed_model::_alloc_edge_cache()
+{
+	if (_edge_prod != nullptr || _low_memory) return;
+	_edge_prod = new float[_graph.edge_num()];
+	_in_edge_rank = new int[_graph.edge_num()];
+	_edge_prod_valid = false;
+	parallel_for([this](int node, size_t thread) { _update_node_edge_rank(node); });
+}
+
+// Where the products of the out-edges of node go: the cache if there is
+// one, else a per-thread buffer for the tiled loops, else nowhere.
+float *affi_directed_model::_node_prods(int node, size_t thread)
+{
+	if (_edge_prod != nullptr) return _edge_prod + _graph.out_edges().degree_sum(node);
+	if (_tile_prods != nullptr) return _tile_prods + thread * _max_out_degree;
+	return nullptr;
 }
 
-void affi_directed_model::update_node(int node)
+void affi_directed_model::_update_node_edge_rank(int node)
 {
-	switch (_task_type)
+	auto in_nbrs = _graph.in_neighbors(node);
+	int *ranks = _in_edge_rank + _graph.in_edges().degree_sum(node);
+	int bi_deg = _graph.bi_degree(node);
+	for (int k = 0; k < _graph.in_degree(node); ++k)
 	{
-	case _parallel_task_type::task_gradient_out:
-		_update_node_gradient_out(node);
-		break;
-	case _parallel_task_type::task_gradient_in:
-		_update_node_gradient_in(node);
-		break;
-	case _parallel_task_type::task_min_neighborhood:
-		_update_node_min_neighborhood(node);
-		break;
-	case _parallel_task_type::task_likelihood:
-		_update_node_likelihood(node);
-		break;
-	case _parallel_task_type::task_make_affi_sum:
-		_update_node_make_affi_sum(node);
-		break;
+		auto out_nbrs = _graph.out_neighbors(in_nbrs[k]);
+		auto first = out_nbrs.begin(), last = out_nbrs.end();
+		if (k < bi_deg) last = first + _graph.bi_degree(in_nbrs[k]);
+		else first += _graph.bi_degree(in_nbrs[k]);
+		ranks[k] = (int)(std::lower_bound(first, last, node) - out_nbrs.begin());
 	}
 }
 
-void affi_directed_model::_update_node_min_neighborhood(int node)
+void affi_directed_model::_update_node_clear(int node)
 {
-	long long cut = 0, degree_sum = _graph.out_degree(node) + _graph.in_degree(node);
-	auto out_nbrs = _graph.out_neighbors(node);
-	auto in_nbrs = _graph.in_neighbors(node);
-	for (int i = 0; i < _graph.out_degree(node); ++i) degree_sum += _graph.out_degree(out_nbrs[i]) + _graph.in_degree(out_nbrs[i]);
-	for (int i = _graph.bi_degree(node); i < _graph.in_degree(node); ++i) degree_sum += _graph.out_degree(in_nbrs[i]) + _graph.in_degree(in_nbrs[i]);
+	size_t offset = (size_t)node * _row_size;
+	memset(_row(_affi_out_data, node), 0, _row_bytes);
+	memset(_row(_affi_in_data, node), 0, _row_bytes);
+	std::fill(_affi_out_d_data + offset, _affi_out_d_data + offset + _row_size, 0.0f);
+	if (_low_memory) return;
+	memset(_row(_affi_out_tmp_data, node), 0, _row_bytes);
+	memset(_row(_affi_in_tmp_data, node), 0, _row_bytes);
+	std::fill(_affi_in_d_data + offset, _affi_in_d_data + offset + _row_size, 0.0f);
+}
 
-	int sample_rate = std::max(1, (int)(degree_sum / 100));
-	int sample_size = 0;
-	long long step_count = 0;
+void affi_directed_model::init_neighborhood(bool *is_seed)
+{
+	affi_seed seed(_graph, _thread_num);
+	int *seeds = new int[_cluster_num];
+	int m = seed.neighborhood(is_seed, seeds, _cluster_num);
+	_init_seeds(seed, seeds, m);
+	delete[] seeds;
+}
 
-	for (int v : out_nbrs)
+void affi_directed_model::init_min_neighborhood(bool *is_seed)
+{
+	affi_seed seed(_graph, _thread_num);
+	int *seeds = new int[_cluster_num];
+	int m = seed.min_neighborhood(is_seed, seeds, _cluster_num);
+	_init_seeds(seed, seeds, m);
+	delete[] seeds;
+}
+
+void affi_directed_model::_init_seeds(affi_seed &seed, int *seeds, int m)
+{
+	int n = _graph.node_num();
+	for (int i = 0; i < n; ++i)
+	{
+		memset(_row(_affi_out_data, i), 0, _row_bytes);
+		memset(_row(_affi_in_data, i), 0, _row_bytes);
+	}
+	for (int c = 0; c < m; ++c)
 	{
-		auto onbrs = _graph.out_neighbors(v);
-		for (int i = (int)(step_count % sample_rate); i < _graph.out_degree(v); i += sample_rate)
+		seed.expand(seeds[c], [&](int v, bool is_out, bool is_in)
 		{
-			int w = onbrs[i];
-			if ((w != node) && !_graph.has_edge(node, w) && !_graph.has_edge(w, node)) ++cut;
-			++sample_size;
+			if (is_out) _kernel.set(_row(_affi_out_data, v), c, 1.0f);
+			if (is_in) _kernel.set(_row(_affi_in_data, v), c, 1.0f);
+		});
+	}
+	_make_affi_sum();
+	_lbfgs_side = -1;
+}
+
+void affi_directed_model::init_random(unsigned seed)
+{
+	std::default_random_engine engine(seed);
+	std::uniform_real_distribution<float> out_distr(0.0f, 1.0f);
+	std::uniform_real_distribution<float> in_distr(0.0f, 1.0f);
+	int n = _graph.node_num();
+	for (int i = 0; i < n; ++i)
+	{
+		for (int c = 0; c < _cluster_num; ++c)
+		{
+			_kernel.set(_row(_affi_out_data, i), c, out_distr(engine));
+			_kernel.set(_row(_affi_in_data, i), c, in_distr(engine));
 		}
-		step_count += _graph.out_degree(v);
+	}
+	_make_affi_sum();
+	_lbfgs_side = -1;
+}
+
+void affi_directed_model::_make_affi_sum()
+{
+	std::fill(_affi_sum_out_part, _affi_sum_out_part + _thread_num * _row_size, 0.0f);
+	std::fill(_affi_sum_in_part, _affi_sum_in_part + _thread_num * _row_size, 0.0f);
+	_edge_prod_valid = false;
+
+	parallel_for([this](int node, size_t thread) { _update_node_make_affi_sum(node, thread); });
+
+	_merge_affi_sum(_affi_sum_out, _affi_sum_out_part);
+	_merge_affi_sum(_affi_sum_in, _affi_sum_in_part);
+}
+
+void affi_directed_model::_merge_affi_sum(float *sum, const float *part)
+{
+	std::fill(sum, sum + _row_size, 0.0f);
+	_add_affi_sum(sum, part);
+}
 
-		auto inbrs = _graph.in_neighbors(v);
-		for (int i = (int)(step_count % sample_rate); i < _graph.in_degree(v); i += sample_rate)
+void affi_directed_model::_add_affi_sum(float *sum, const float *part)
+{
+	for (size_t t = 0; t < _thread_num; ++t)
+	{
+		const float *p = part + t * _row_size;
+		for (int c = 0; c < _row_size; ++c) sum[c] += p[c];
+	}
+}
+
+// Writes one line-search candidate and, in the same pass, the cluster sums
+// of the side being updated; the other side is unchanged.
+void affi_directed_model::_make_step(bool is_out, float alpha)
+{
+	float *part = is_out ? _affi_sum_out_part : _affi_sum_in_part;
+	std::fill(part, part + _thread_num * _row_size, 0.0f);
+	_step_alpha = alpha;
+	if (is_out)
+	{
+		parallel_for([this](int node, size_t thread)
 		{
-			int w = inbrs[i];
-			if ((w != node) && !_graph.has_edge(node, w) && !_graph.has_edge(w, node)) ++cut;
-			++sample_size;
+			_kernel.step_sum(_row(_affi_out_data, node), _row(_affi_out_tmp_data, node), _step_alpha, _affi_out_d[node], _affi_sum_out_part + thread * _row_size, _row_size);
+		});
+	}
+	else
+	{
+		parallel_for([this](int node, size_t thread)
+		{
+			_kernel.step_sum(_row(_affi_in_data, node), _row(_affi_in_tmp_data, node), _step_alpha, _affi_in_d[node], _affi_sum_in_part + thread * _row_size, _row_size);
+		});
+	}
+	_merge_affi_sum(is_out ? _affi_sum_out : _affi_sum_in, part);
+	_edge_prod_valid = false;
+}
+
+// Moves the rows of one side to max(0, row + _step_alpha * d) in place.
+void affi_directed_model::_apply_step(bool is_out)
+{
+	if (is_out)
+	{
+		parallel_for([this](int node, size_t thread)
+		{
+			_kernel.step(_row(_affi_out_data, node), _row(_affi_out_data, node), _step_alpha, _affi_out_d[node], _row_size);
+		});
+	}
+	else
+	{
+		parallel_for([this](int node, size_t thread)
+		{
+			_kernel.step(_row(_affi_in_data, node), _row(_affi_in_data, node), _step_alpha, _affi_in_d[node], _row_size);
+		});
+	}
+}
+
+void affi_directed_model::_update_node_make_affi_sum(int node, size_t thread)
+{
+	_kernel.axpy(_affi_sum_out_part + thread * _row_size, 1.0f, _row(_affi_out_data, node), _row_size);
+	_kernel.axpy(_affi_sum_in_part + thread * _row_size, 1.0f, _row(_affi_in_data, node), _row_size);
+}
+
+void affi_directed_model::_update_node_likelihood(int node, size_t thread)
+{
+	auto out_nbrs = _graph.out_neighbors(node);
+	float *prods = _node_prods(node, thread);
+	const void *row = _row(_affi_out_data, node);
+	float sum = _kernel.dot(row, _row(_affi_in_data, node), _row_size) - _kernel.dot_vec(row, _affi_sum_in, _row_size);
+	if (_tile_size > 0)
+	{
+		_tiled_dots(row, _affi_in_data, out_nbrs, prods);
+		for (int k = 0; k < _graph.out_degree(node); ++k)
+		{
+			float affi_prod_sum = *prods++;
+			float p = std::max(-expm1(-affi_prod_sum), _background_prob);
+			sum += affi_prod_sum + log(p);
 		}
-		step_count += _graph.in_degree(v);
+		_likelihood_buf[node] = sum;
+		return;
+	}
+	for (auto nbr = out_nbrs.begin(); nbr != out_nbrs.end(); ++nbr)
+	{
+		int v = *nbr;
+		_prefetch_row(_affi_in_data, nbr, out_nbrs.end());
+		float affi_prod_sum = _kernel.dot(row, _row(_affi_in_data, v), _row_size);
+		if (prods != nullptr) *prods++ = affi_prod_sum;
+		sum += affi_prod_sum;
+		float p = std::max(-expm1(-affi_prod_sum), _background_prob);
+		sum += log(p);
 	}
+	_likelihood_buf[node] = sum;
+}
+
+float affi_directed_model::likelihood()
+{
+	if (_likelihood <= 0.0) return _likelihood;
+	_likelihood = parallel_reduce(0.0f, [this](int node, size_t thread)
+	{
+		_update_node_likelihood(node, thread);
+		return _likelihood_buf[node];
+	}, std::plus<float>());
+	_edge_prod_valid = _edge_prod != nullptr;
+	return _likelihood;
+}
 
-	for (int z = _graph.bi_degree(node); z < _graph.in_degree(node); ++z)
+// Runs a pass whose nodes accumulate into several per-thread partials (one
+// cache line per thread) and returns the total of the first.
+template <class Func> float affi_directed_model::_update_reduce(const Func &fn)
+{
+	std::fill(_thread_sum, _thread_sum + _thread_num * affi_row_align, 0.0f);
+	parallel_for(fn);
+	return _thread_total(0);
+}
+
+// Sum of the squared gradient rows of one side.
+float affi_directed_model::_gradient_norm(bool is_out)
+{
+	float **d = is_out ? _affi_out_d : _affi_in_d;
+	return parallel_reduce(0.0f, [this, d](int node, size_t thread) { return _kernel.norm(d[node], _row_size); }, std::plus<float>());
+}
+
+float affi_directed_model::_thread_total(int slot)
+{
+	float sum = 0.0;
+	for (size_t t = 0; t < _thread_num; ++t)
 	{
-		int v = in_nbrs[z];
-		auto onbrs = _graph.out_neighbors(v);
-		for (int i = (int)(step_count % sample_rate); i < _graph.out_degree(v); i += sample_rate)
+		sum += _thread_sum[t * affi_row_align + slot];
+	}
+	return sum;
+}
+
+void affi_directed_model::set_optimizer(affi_optimizer *optimizer)
+{
+	_optimizer = optimizer;
+	if (_optimizer == nullptr) return;
+	_optimizer->init(_graph.node_num(), _row_size);
+	_reset_optimizer(true);
+	_reset_optimizer(false);
+}
+
+void affi_directed_model::_reset_optimizer(bool is_out)
+{
+	_optimizer->reset(is_out);
+	parallel_for([this, is_out](int node, size_t thread) { _optimizer->clear(is_out, node); });
+}
+
+void affi_directed_model::_update_node_direction(int node, size_t thread, bool is_out)
+{
+	float *d = is_out ? _affi_out_d[node] : _affi_in_d[node];
+	float *g = _scratch_row + thread * _row_size;
+	float *sum = _thread_sum + thread * affi_row_align;
+	std::copy(d, d + _row_size, g);
+	_optimizer->direction(is_out, node, d);
+	float slope = 0.0f;
+	for (int c = 0; c < _row_size; ++c) slope += g[c] * d[c];
+	sum[0] += slope;
+	sum[1] += _kernel.norm(d, _row_size);
+}
+
+// Turns the gradient rows of one side into the search direction, scales the
+// initial step alpha by its length and returns the directional derivative
+// used by the sufficient-increase test. Falls back to the plain gradient,
+// with the optimizer reset, when the direction is not an ascent direction.
+float affi_directed_model::_make_direction(bool is_out, float &alpha)
+{
+	float slope;
+	if (_lbfgs_size > 0)
+	{
+		if (_make_lbfgs_direction(is_out, &slope))
+		{
+			alpha = 1.0f;
+			return slope;
+		}
+	}
+	else if (_optimizer != nullptr)
+	{
+		_optimizer->begin(is_out);
+		slope = _update_reduce([this, is_out](int node, size_t thread) { _update_node_direction(node, thread, is_out); });
+		if (slope > 0.0f)
 		{
-			int w = onbrs[i];
-			if ((w != node) && !_graph.has_edge(node, w) && !_graph.has_edge(w, node)) ++cut;
-			++sample_size;
+			alpha /= sqrt(_thread_total(1));
+			return slope;
 		}
-		step_count += _graph.out_degree(v);
+		_reset_optimizer(is_out);
+		if (is_out) _make_gradient_out();
+		else _make_gradient_in();
+	}
+	slope = _gradient_norm(is_out);
+	alpha /= sqrt(slope);
+	return slope;
+}
+
+void affi_directed_model::_reset_direction(bool is_out)
+{
+	if (_optimizer != nullptr) _reset_optimizer(is_out);
+	_lbfgs_count = 0;
+	_lbfgs_side = -1;
+}
 
-		auto inbrs = _graph.in_neighbors(v);
-		for (int i = (int)(step_count % sample_rate); i < _graph.in_degree(v); i += sample_rate)
+void affi_directed_model::set_lbfgs(int history)
+{
+	_free_lbfgs();
+	_lbfgs_size = history;
+	_lbfgs_count = 0;
+	_lbfgs_head = 0;
+	_lbfgs_side = -1;
+	if (history <= 0) return;
+
+	size_t size = (size_t)_graph.node_num() * _row_size;
+	_lbfgs_s = new float*[history];
+	_lbfgs_y = new float*[history];
+	for (int i = 0; i < history; ++i)
+	{
+		_lbfgs_s[i] = affi_alloc(size);
+		_lbfgs_y[i] = affi_alloc(size);
+	}
+	_lbfgs_rho = new float[history];
+	_lbfgs_a = new float[history];
+	_lbfgs_x = affi_alloc(size);
+	_lbfgs_g = affi_alloc(size);
+	parallel_for([this](int node, size_t thread) { _update_node_clear_lbfgs(node); });
+}
+
+void affi_directed_model::_update_node_clear_lbfgs(int node)
+{
+	size_t offset = (size_t)node * _row_size;
+	for (int i = 0; i < _lbfgs_size; ++i)
+	{
+		std::fill(_lbfgs_s[i] + offset, _lbfgs_s[i] + offset + _row_size, 0.0f);
+		std::fill(_lbfgs_y[i] + offset, _lbfgs_y[i] + offset + _row_size, 0.0f);
+	}
+	std::fill(_lbfgs_x + offset, _lbfgs_x + offset + _row_size, 0.0f);
+	std::fill(_lbfgs_g + offset, _lbfgs_g + offset + _row_size, 0.0f);
+}
+
+void affi_directed_model::_free_lbfgs()
+{
+	for (int i = 0; i < _lbfgs_size; ++i)
+	{
+		affi_free(_lbfgs_s[i]);
+		affi_free(_lbfgs_y[i]);
+	}
+	delete[] _lbfgs_s;
+	delete[] _lbfgs_y;
+	delete[] _lbfgs_rho;
+	delete[] _lbfgs_a;
+	affi_free(_lbfgs_x);
+	affi_free(_lbfgs_g);
+	_lbfgs_s = _lbfgs_y = nullptr;
+	_lbfgs_rho = _lbfgs_a = nullptr;
+	_lbfgs_x = _lbfgs_g = nullptr;
+	_lbfgs_size = 0;
+	_lbfgs_count = 0;
+}
+
+// Stores s = x - x_prev and y = g_prev - g (the gradient of the negated
+// likelihood) at the history head when the previous step was on the same
+// side, then keeps x and g for the next pair and drops from the gradient
+// the coordinates held at zero.
+void affi_directed_model::_update_node_lbfgs_pair(int node, size_t thread)
+{
+	size_t offset = (size_t)node * _row_size;
+	bool is_out = _lbfgs_side == 0;
+	float *d = is_out ? _affi_out_d[node] : _affi_in_d[node];
+	float *x = _lbfgs_x + offset, *g = _lbfgs_g + offset;
+	float *cur = _scratch_row + thread * _row_size;
+	float *sum = _thread_sum + thread * affi_row_align;
+	_kernel.load(cur, is_out ? _row(_affi_out_data, node) : _row(_affi_in_data, node), _row_size);
+	if (_lbfgs_dot != nullptr)
+	{
+		float *s = _lbfgs_s[_lbfgs_head] + offset, *y = _lbfgs_y[_lbfgs_head] + offset;
+		float sy = 0.0f, yy = 0.0f;
+		for (int c = 0; c < _row_size; ++c)
 		{
-			int w = inbrs[i];
-			if ((w != node) && !_graph.has_edge(node, w) && !_graph.has_edge(w, node)) ++cut;
-			++sample_size;
+			s[c] = cur[c] - x[c];
+			y[c] = g[c] - d[c];
+			sy += s[c] * y[c];
+			yy += y[c] * y[c];
 		}
-		step_count += _graph.in_degree(v);
+		sum[0] += sy;
+		sum[1] += yy;
 	}
+	std::copy(cur, cur + _row_size, x);
+	std::copy(d, d + _row_size, g);
+	for (int c = 0; c < _row_size; ++c)
+	{
+		if (cur[c] <= 0.0f && d[c] < 0.0f) d[c] = 0.0f;
+	}
+}
 
-	cut = (cut == 0 || degree_sum == 0) ? 0 : cut * degree_sum / sample_size;
-	long long size = std::min(degree_sum, _graph.edge_num());
-	_conductance_tmp[node] = (size == 0) ? 1e38f : (float)cut / (float)size;
+// d = gain * d + coef * axpy, then sum += dot . d
+void affi_directed_model::_update_node_lbfgs_pass(int node, size_t thread)
+{
+	size_t offset = (size_t)node * _row_size;
+	float *d = _lbfgs_side == 0 ? _affi_out_d[node] : _affi_in_d[node];
+	if (_lbfgs_axpy != nullptr)
+	{
+		const float *v = _lbfgs_axpy + offset;
+		for (int c = 0; c < _row_size; ++c) d[c] = _lbfgs_gain * d[c] + _lbfgs_coef * v[c];
+	}
+	if (_lbfgs_dot != nullptr)
+	{
+		const float *v = _lbfgs_dot + offset;
+		float dot = 0.0f;
+		for (int c = 0; c < _row_size; ++c) dot += v[c] * d[c];
+		_thread_sum[thread * affi_row_align] += dot;
+	}
 }
 
-void affi_directed_model::init_neighborhood(bool *is_seed)
+// Last update of the two-loop recursion, projected onto the feasible
+// directions at x; sums g . d and |d|^2.
+void affi_directed_model::_update_node_lbfgs_final(int node, size_t thread)
 {
-	int n = _graph.node_num(), m = 0;
-	auto pairs = new std::pair<int, int>[n];
-	for (int i = 0; i < n; ++i)
+	size_t offset = (size_t)node * _row_size;
+	float *d = _lbfgs_side == 0 ? _affi_out_d[node] : _affi_in_d[node];
+	const float *x = _lbfgs_x + offset, *g = _lbfgs_g + offset, *v = _lbfgs_axpy + offset;
+	float *sum = _thread_sum + thread * affi_row_align;
+	float slope = 0.0f, norm = 0.0f;
+	for (int c = 0; c < _row_size; ++c)
 	{
-		if (is_seed[i]) pairs[m++] = std::make_pair(_graph.out_degree(i) + _graph.in_degree(i) - _graph.bi_degree(i) + 1, i);
+		float t = d[c] + _lbfgs_coef * v[c];
+		if (x[c] <= 0.0f && t < 0.0f) t = 0.0f;
+		d[c] = t;
+		slope += g[c] * t;
+		norm += t * t;
 	}
-	printf("%d seeds\n", m);
-	std::sort(pairs, pairs + m);
-	std::reverse(pairs, pairs + m);
-	for (int i = 0; i < n; ++i)
+	sum[0] += slope;
+	sum[1] += norm;
+}
+
+template <class Func> float affi_directed_model::_lbfgs_pass(const Func &fn, const float *axpy, float coef, float gain, const float *dot)
+{
+	_lbfgs_axpy = axpy;
+	_lbfgs_coef = coef;
+	_lbfgs_gain = gain;
+	_lbfgs_dot = dot;
+	return _update_reduce(fn);
+}
+
+// Two-loop recursion over the stored pairs, one pass over the gradient rows
+// per pair and loop. The history only spans consecutive steps on one side:
+// a step on the other side changes the subproblem and starts it over.
+// Returns false, with the plain gradient left in place, while there is no
+// usable history or when the result is not an ascent direction.
+bool affi_directed_model::_make_lbfgs_direction(bool is_out, float *slope)
+{
+	int side = is_out ? 0 : 1;
+	bool pair = _lbfgs_side == side;
+	auto pair_pass = [this](int node, size_t thread) { _update_node_lbfgs_pair(node, thread); };
+	auto step_pass = [this](int node, size_t thread) { _update_node_lbfgs_pass(node, thread); };
+	auto final_pass = [this](int node, size_t thread) { _update_node_lbfgs_final(node, thread); };
+	_lbfgs_side = side;
+	_lbfgs_pass(pair_pass, nullptr, 0.0f, 1.0f, pair ? _lbfgs_x : nullptr);
+	if (!pair)
+	{
+		_lbfgs_count = 0;
+		return false;
+	}
+
+	float sy = _thread_total(0), yy = _thread_total(1);
+	if (!(sy > 1e-10f * yy) || yy <= 0.0f)
+	{
+		_lbfgs_count = 0;
+		return false;
+	}
+	_lbfgs_rho[_lbfgs_head] = 1.0f / sy;
+	_lbfgs_gamma = sy / yy;
+	_lbfgs_head = (_lbfgs_head + 1) % _lbfgs_size;
+	_lbfgs_count = std::min(_lbfgs_count + 1, _lbfgs_size);
+
+	const float *axpy = nullptr;
+	float coef = 0.0f;
+	for (int j = 0; j < _lbfgs_count; ++j)
 	{
-		std::fill(_affi_out[i], _affi_out[i] + _cluster_num, 0.0f);
-		std::fill(_affi_in[i], _affi_in[i] + _cluster_num, 0.0f);
+		int i = (_lbfgs_head - 1 - j + _lbfgs_size) % _lbfgs_size;
+		_lbfgs_a[i] = _lbfgs_rho[i] * _lbfgs_pass(step_pass, axpy, coef, 1.0f, _lbfgs_s[i]);
+		axpy = _lbfgs_y[i];
+		coef = -_lbfgs_a[i];
 	}
-	for (int c = 0; c < _cluster_num && c < m; ++c)
+	float gain = _lbfgs_gamma;
+	for (int j = _lbfgs_count - 1; j >= 0; --j)
 	{
-		int node = pairs[c].second;
-		int size = pairs[c].first;
-		//printf("Node = %d, size = %d\n", node, size);
+		int i = (_lbfgs_head - 1 - j + _lbfgs_size) % _lbfgs_size;
+		float beta = _lbfgs_rho[i] * _lbfgs_pass(step_pass, axpy, coef * gain, gain, _lbfgs_y[i]);
+		gain = 1.0f;
+		axpy = _lbfgs_s[i];
+		coef = _lbfgs_a[i] - beta;
+	}
+	*slope = _lbfgs_pass(final_pass, axpy, coef, 1.0f, nullptr);
+	if (*slope > 0.0f) return true;
+
+	_lbfgs_count = 0;
+	_lbfgs_pass(step_pass, _lbfgs_g, 1.0f, 0.0f, nullptr);
+	return false;
+}
+
+float affi_directed_model::likelihood(int node)
+{
+	likelihood();
+	return _likelihood_buf[node];
+}
 
-		auto out_nbrs = _graph.out_neighbors(node);
-		auto in_nbrs = _graph.in_neighbors(node);
-		int out_deg = _graph.out_degree(node);
-		int in_deg = _graph.in_degree(node);
-		int bi_deg = _graph.bi_degree(node);
+float affi_directed_model::likelihood(bool *used)
+{
+	likelihood();
+	if (used == NULL) return _likelihood;
+	return parallel_reduce(0.0f, [this, used](int node, size_t thread) { return used[node] ? _likelihood_buf[node] : 0.0f; }, std::plus<float>());
+}
 
-		int *nodes = new int[in_deg + out_deg - bi_deg];
-		std::copy(out_nbrs.begin(), out_nbrs.end(), nodes);
-		std::copy(in_nbrs.begin() + bi_deg, in_nbrs.end(), nodes + out_deg);
-		std::sort(nodes, nodes + in_deg + out_deg - bi_deg);
+void affi_directed_model::_update_node_gradient_out(int node)
+{
+	float *d = _affi_out_d[node];
+	_kernel.sub(d, _row(_affi_in_data, node), _affi_sum_in, _row_size);
+	auto out_nbrs = _graph.out_neighbors(node);
+	const float *prods = _edge_prod + _graph.out_edges().degree_sum(node);
+	if (_tile_size > 0)
+	{
+		_tiled_gradient(d, _affi_in_data, out_nbrs, prods);
+		return;
+	}
+	for (auto nbr = out_nbrs.begin(); nbr != out_nbrs.end(); ++nbr)
+	{
+		int v = *nbr;
+		_prefetch_row(_affi_in_data, nbr, out_nbrs.end());
+		float p = std::max(-expm1(-*prods++), _background_prob);
+		_kernel.axpy(d, 1.0f / p, _row(_affi_in_data, v), _row_size);
+	}
+}
 
-		for (int i = 0; i < bi_deg; ++i)
+void affi_directed_model::_update_node_likelihood_gradient_out(int node, size_t thread)
+{
+	float *d = _affi_out_d[node];
+	const void *row = _row(_affi_out_data, node);
+	_kernel.sub(d, _row(_affi_in_data, node), _affi_sum_in, _row_size);
+	auto out_nbrs = _graph.out_neighbors(node);
+	float *prods = _node_prods(node, thread);
+	float sum = _kernel.dot(row, _row(_affi_in_data, node), _row_size) - _kernel.dot_vec(row, _affi_sum_in, _row_size);
+	if (_tile_size > 0)
+	{
+		_tiled_dots(row, _affi_in_data, out_nbrs, prods);
+		_tiled_gradient(d, _affi_in_data, out_nbrs, prods);
+		for (int k = 0; k < _graph.out_degree(node); ++k)
 		{
-			int v = out_nbrs[i];
-			_affi_out[v][c] = 1.0;
-			_affi_in[v][c] = 1.0;
+			float affi_prod_sum = *prods++;
+			float p = std::max(-expm1(-affi_prod_sum), _background_prob);
+			sum += affi_prod_sum + log(p);
 		}
+		_likelihood_buf[node] = sum;
+		return;
+	}
+	for (auto nbr = out_nbrs.begin(); nbr != out_nbrs.end(); ++nbr)
+	{
+		int v = *nbr;
+		_prefetch_row(_affi_in_data, nbr, out_nbrs.end());
+		float affi_prod_sum = _kernel.dot(row, _row(_affi_in_data, v), _row_size);
+		if (prods != nullptr) *prods++ = affi_prod_sum;
+		sum += affi_prod_sum;
+		float p = std::max(-expm1(-affi_prod_sum), _background_prob);
+		sum += log(p);
+		_kernel.axpy(d, 1.0f / p, _row(_affi_in_data, v), _row_size);
+	}
+	_likelihood_buf[node] = sum;
+}
 
-		for (int i = bi_deg; i < out_deg; ++i)
+void affi_directed_model::_update_node_gradient_in(int node)
+{
+	float *d = _affi_in_d[node];
+	_kernel.sub(d, _row(_affi_out_data, node), _affi_sum_out, _row_size);
+	auto in_nbrs = _graph.in_neighbors(node);
+	const int *ranks = _in_edge_rank + _graph.in_edges().degree_sum(node);
+	if (_tile_size > 0)
+	{
+		size_t elem_bytes = _row_bytes / _row_size;
+		for (int c0 = 0; c0 < _row_size; c0 += _tile_size)
 		{
-			int v = out_nbrs[i];
-			_affi_in[v][c] = 1.0;
-			for (int w : _graph.out_neighbors(v))
+			int k = std::min(_tile_size, _row_size - c0);
+			const int *tile_ranks = ranks;
+			for (int u : in_nbrs)
 			{
-				if (std::binary_search(nodes, nodes + in_deg + out_deg - bi_deg, w))
-				{
-					_affi_out[v][c] = 1.0;
-					break;
-				}
+				float affi_prod_sum = _edge_prod[_graph.out_edges().degree_sum(u) + *tile_ranks++];
+				float p = std::max(-expm1(-affi_prod_sum), _background_prob);
+				_tile_kernel.axpy(d + c0, 1.0f / p, (const char *)_row(_affi_out_data, u) + c0 * elem_bytes, k);
 			}
 		}
+		return;
+	}
+	for (auto nbr = in_nbrs.begin(); nbr != in_nbrs.end(); ++nbr)
+	{
+		int u = *nbr;
+		_prefetch_row(_affi_out_data, nbr, in_nbrs.end());
+		float affi_prod_sum = _edge_prod[_graph.out_edges().degree_sum(u) + *ranks++];
+		float p = std::max(-expm1(-affi_prod_sum), _background_prob);
+		_kernel.axpy(d, 1.0f / p, _row(_affi_out_data, u), _row_size);
+	}
+}
+
+// Cluster-tiled edge loops for large K: each pass over the neighbours
+// touches one tile of their rows, so the tile of the node's own row (or of
+// its gradient) stays in L1 while the neighbour tiles stream through.
+void affi_directed_model::_tiled_dots(const void *row, const void *rows, graph_t::neighbor_container nbrs, float *prods)
+{
+	size_t elem_bytes = _row_bytes / _row_size;
+	int deg = (int)(nbrs.end() - nbrs.begin());
+	std::fill(prods, prods + deg, 0.0f);
+	for (int c0 = 0; c0 < _row_size; c0 += _tile_size)
+	{
+		int k = std::min(_tile_size, _row_size - c0);
+		const char *a = (const char *)row + c0 * elem_bytes;
+		float *p = prods;
+		for (int v : nbrs) *p++ += _tile_kernel.dot(a, (const char *)_row(rows, v) + c0 * elem_bytes, k);
+	}
+}
 
-		for (int i = bi_deg; i < in_deg; ++i)
+// d += rows[v] / p for the edge probabilities p of prods
+void affi_directed_model::_tiled_gradient(float *d, const void *rows, graph_t::neighbor_container nbrs, const float *prods)
+{
+	size_t elem_bytes = _row_bytes / _row_size;
+	for (int c0 = 0; c0 < _row_size; c0 += _tile_size)
+	{
+		int k = std::min(_tile_size, _row_size - c0);
+		const float *prod = prods;
+		for (int v : nbrs)
 		{
-			int v = in_nbrs[i];
-			_affi_out[v][c] = 1.0;
-			for (int w : _graph.in_neighbors(v))
-			{
-				if (std::binary_search(nodes, nodes + in_deg + out_deg - bi_deg, w))
-				{
-					_affi_in[v][c] = 1.0;
-					break;
-				}
-			}
+			float p = std::max(-expm1(-*prod++), _background_prob);
+			_tile_kernel.axpy(d + c0, 1.0f / p, (const char *)_row(rows, v) + c0 * elem_bytes, k);
 		}
+	}
+}
+
+void affi_directed_model::set_cluster_tile(int tile_size)
+{
+	_tile_size = affi_padded_size(std::max(tile_size, 0));
+	if (_tile_size >= _row_size) _tile_size = 0;
+	delete[] _tile_prods;
+	_tile_prods = nullptr;
+	if (_tile_size == 0) return;
+	_max_out_degree = 0;
+	for (int i = 0; i < _graph.node_num(); ++i) _max_out_degree = std::max(_max_out_degree, (int)_graph.out_degree(i));
+	_tile_prods = new float[_thread_num * std::max(_max_out_degree, 1)];
+}
+
+void affi_directed_model::set_prefetch_distance(int distance)
+{
+	_prefetch_distance = std::max(distance, 0);
+}
 
-		delete[] nodes;
+void affi_directed_model::_make_gradient_out()
+{
+	_alloc_edge_cache();
+	if (_edge_prod_valid)
+	{
+		parallel_for([this](int node, size_t thread) { _update_node_gradient_out(node); });
+	}
+	else
+	{
+		_likelihood = parallel_reduce(0.0f, [this](int node, size_t thread)
+		{
+			_update_node_likelihood_gradient_out(node, thread);
+			return _likelihood_buf[node];
+		}, std::plus<float>());
+		_edge_prod_valid = _edge_prod != nullptr;
 	}
-	delete[] pairs;
-	_make_affi_sum();
 }
 
-void affi_directed_model::init_min_neighborhood(bool *is_seed)
+// Without the edge cache (low-memory mode) the in-edge products are
+// recomputed along with the gradient.
+void affi_directed_model::_make_gradient_in()
 {
-	_task_type = _parallel_task_type::task_min_neighborhood;
+	_alloc_edge_cache();
+	if (_edge_prod == nullptr)
+	{
+		parallel_for([this](int node, size_t thread) { _update_node_likelihood_gradient_in(node, _affi_sum_out, nullptr); });
+		return;
+	}
+	if (!_edge_prod_valid)
+	{
+		_likelihood = 1.0;
+		likelihood();
+	}
+	parallel_for([this](int node, size_t thread) { _update_node_gradient_in(node); });
+}
 
-	update();
+float affi_directed_model::iterate_out(float alpha, float scale, float decay, bool *is_train)
+{
+	if (_low_memory) return _iterate_low_memory(true, alpha, scale, decay, is_train);
+	float l0 = likelihood(is_train);
+	_make_gradient_out();
+	float m = _make_direction(true, alpha);
+	float cm = m * scale;
 
-	int n = _graph.node_num(), m = 0;
-	auto pairs = new std::pair<int, int>[n];
-	for (int i = 0; i < n; ++i)
+	printf("alpha = %g, m = %f, cm = %f\n", alpha, m, cm);
+
+	int loop = 0;
+	if (_multi_num > 1)
 	{
-		bool is_min = true;
-		bool has_seed_neighbor = false;
+		float step = _multi_step(true, alpha, decay, l0, cm, is_train);
+		if (step > 0.0f) return step;
+		loop = _multi_num;
+		alpha *= pow(decay, loop);
+	}
 
-		auto out_nbrs = _graph.out_neighbors(i);
-		for (int j : out_nbrs)
-		{
-			if (is_seed == nullptr || is_seed[j]) has_seed_neighbor = true;
-			if (_conductance_tmp[i] >= _conductance_tmp[j])
-			{
-				is_min = false;
-				break;
-			}
-		}
+	std::swap(_affi_out_data, _affi_out_tmp_data);
+	std::swap(_likelihood_buf, _likelihood_buf_tmp);
+	std::swap(_likelihood, _likelihood_tmp);
+	std::copy(_affi_sum_out, _affi_sum_out + _row_size, _affi_sum_tmp);
+
+	//while (alpha > 1e-6)
+	for (; loop < 10; ++loop)
+	{
+		_make_step(true, alpha);
+		_likelihood = 1.0;
+		float l1 = likelihood(is_train);
+
+		printf("alpha = %g, improve = %f\n", alpha, (l0 - l1) / l0);
+
+		if (l1 > l0 + alpha * cm) return alpha;
+		alpha *= decay;
+	}
+
+	std::swap(_affi_out_data, _affi_out_tmp_data);
+	std::swap(_likelihood_buf, _likelihood_buf_tmp);
+	std::swap(_likelihood, _likelihood_tmp);
+	std::copy(_affi_sum_tmp, _affi_sum_tmp + _row_size, _affi_sum_out);
+	_edge_prod_valid = false;
+	_reset_direction(true);
+	return 0.0;
+}
+
+float affi_directed_model::iterate_in(float alpha, float scale, float decay, bool *is_train)
+{
+	if (_low_memory) return _iterate_low_memory(false, alpha, scale, decay, is_train);
+	float l0 = likelihood(is_train);
+	_make_gradient_in();
+	float m = _make_direction(false, alpha);
+	float cm = m * scale;
+
+	printf("alpha = %g, m = %f, cm = %f\n", alpha, m, cm);
+
+	int loop = 0;
+	if (_multi_num > 1)
+	{
+		float step = _multi_step(false, alpha, decay, l0, cm, is_train);
+		if (step > 0.0f) return step;
+		loop = _multi_num;
+		alpha *= pow(decay, loop);
+	}
+
+	std::swap(_affi_in_data, _affi_in_tmp_data);
+	std::swap(_likelihood_buf, _likelihood_buf_tmp);
+	std::swap(_likelihood, _likelihood_tmp);
+	std::copy(_affi_sum_in, _affi_sum_in + _row_size, _affi_sum_tmp);
+
+	//while (alpha > 1e-6)
+	for (; loop < 10; ++loop)
+	{
+		_make_step(false, alpha);
+		_likelihood = 1.0;
+		float l1 = likelihood(is_train);
+
+		printf("alpha = %g, improve = %f\n", alpha, (l0 - l1) / l0);
+
+		if (l1 > l0 + alpha * cm) return alpha;
+		alpha *= decay;
+	}
+
+	std::swap(_affi_in_data, _affi_in_tmp_data);
+	std::swap(_likelihood_buf, _likelihood_buf_tmp);
+	std::swap(_likelihood, _likelihood_tmp);
+	std::copy(_affi_sum_tmp, _affi_sum_tmp + _row_size, _affi_sum_in);
+	_edge_prod_valid = false;
+	_reset_direction(false);
+	return 0.0;
+}
+
+float affi_directed_model::iterate_joint(float alpha, float scale, float decay, bool *is_train)
+{
+	if (_low_memory || _optimizer != nullptr || _lbfgs_size > 0 || _multi_num > 1)
+	{
+		float step = iterate_out(alpha, scale, decay, is_train);
+		return std::max(step, iterate_in(alpha, scale, decay, is_train));
+	}
+	_lbfgs_side = -1;
+	_make_gradient_out();
+	_make_gradient_in();
+	float l0 = likelihood(is_train);
+	float m = _gradient_norm(true) + _gradient_norm(false);
+	std::swap(_affi_out_data, _affi_out_tmp_data);
+	std::swap(_affi_in_data, _affi_in_tmp_data);
+	std::swap(_likelihood_buf, _likelihood_buf_tmp);
+	std::swap(_likelihood, _likelihood_tmp);
+
+	float cm = m * scale;
+	alpha /= sqrt(m);
+	float *affi_sum_out_tmp = _affi_sum_tmp, *affi_sum_in_tmp = _affi_sum_tmp + _row_size;
+	std::copy(_affi_sum_out, _affi_sum_out + _row_size, affi_sum_out_tmp);
+	std::copy(_affi_sum_in, _affi_sum_in + _row_size, affi_sum_in_tmp);
+
+	printf("alpha = %g, m = %f, cm = %f\n", alpha, m, cm);
+
+	for (int loop = 0; loop < 10; ++loop)
+	{
+		_make_step(true, alpha);
+		_make_step(false, alpha);
+		_likelihood = 1.0;
+		float l1 = likelihood(is_train);
+
+		printf("alpha = %g, improve = %f\n", alpha, (l0 - l1) / l0);
+
+		if (l1 > l0 + alpha * cm) return alpha;
+		alpha *= decay;
+	}
+
+	std::swap(_affi_out_data, _affi_out_tmp_data);
+	std::swap(_affi_in_data, _affi_in_tmp_data);
+	std::swap(_likelihood_buf, _likelihood_buf_tmp);
+	std::swap(_likelihood, _likelihood_tmp);
+	std::copy(affi_sum_out_tmp, affi_sum_out_tmp + _row_size, _affi_sum_out);
+	std::copy(affi_sum_in_tmp, affi_sum_in_tmp + _row_size, _affi_sum_in);
+	_edge_prod_valid = false;
+	return 0.0;
+}
+
+// Likelihood of the out-row of node against the in-candidates
+// max(0, in + alpha * d), which are never stored; _affi_sum_in already
+// holds the candidate sums.
+void affi_directed_model::_update_node_likelihood_step_in(int node, size_t thread)
+{
+	auto out_nbrs = _graph.out_neighbors(node);
+	float *prods = _node_prods(node, thread);
+	const void *row = _row(_affi_out_data, node);
+	float sum = _kernel.dot_step(row, _row(_affi_in_data, node), _step_alpha, _affi_in_d[node], _row_size) - _kernel.dot_vec(row, _affi_sum_in, _row_size);
+	for (auto nbr = out_nbrs.begin(); nbr != out_nbrs.end(); ++nbr)
+	{
+		int v = *nbr;
+		_prefetch_row(_affi_in_data, nbr, out_nbrs.end());
+		float affi_prod_sum = _kernel.dot_step(row, _row(_affi_in_data, v), _step_alpha, _affi_in_d[v], _row_size);
+		if (prods != nullptr) *prods++ = affi_prod_sum;
+		sum += affi_prod_sum;
+		float p = std::max(-expm1(-affi_prod_sum), _background_prob);
+		sum += log(p);
+	}
+	_likelihood_buf[node] = sum;
+}
 
-		auto in_nbrs = _graph.in_neighbors(i);
-		for (int j : in_nbrs)
-		{
-			if (is_seed == nullptr || is_seed[j]) has_seed_neighbor = true;
-			if (_conductance_tmp[i] >= _conductance_tmp[j])
-			{
-				is_min = false;
-				break;
-			}
-		}
+float affi_directed_model::_iterate_low_memory(bool is_out, float alpha, float scale, float decay, bool *is_train)
+{
+	float l0 = likelihood(is_train);
+	if (is_out) _make_gradient_out();
+	else _make_gradient_in();
+	float m = _make_direction(is_out, alpha);
+	float cm = m * scale;
 
-		if (is_min && has_seed_neighbor) pairs[m++] = std::make_pair(_graph.out_degree(i) + _graph.in_degree(i) - _graph.bi_degree(i) + 1, i);
-	}
-	printf("%d seeds\n", m);
-	std::sort(pairs, pairs + m);
-	std::reverse(pairs, pairs + m);
-	for (int i = 0; i < n; ++i)
+	printf("alpha = %g, m = %f, cm = %f\n", alpha, m, cm);
+
+	int loop = 0;
+	if (_multi_num > 1)
 	{
-		std::fill(_affi_out[i], _affi_out[i] + _cluster_num, 0.0f);
-		std::fill(_affi_in[i], _affi_in[i] + _cluster_num, 0.0f);
+		float step = _multi_step(is_out, alpha, decay, l0, cm, is_train);
+		if (step > 0.0f) return step;
+		loop = _multi_num;
+		alpha *= pow(decay, loop);
 	}
-	for (int c = 0; c < _cluster_num && c < m; ++c)
-	{
-		int node = pairs[c].second;
-		int size = pairs[c].first;
-		//printf("node = %d %s, size = %d\n", node, _graph.node_attr(node), size);
 
-		auto out_nbrs = _graph.out_neighbors(node);
-		auto in_nbrs = _graph.in_neighbors(node);
-		int out_deg = _graph.out_degree(node);
-		int in_deg = _graph.in_degree(node);
-		int bi_deg = _graph.bi_degree(node);
-		
-		int *nodes = new int[in_deg + out_deg - bi_deg];
-		std::copy(out_nbrs.begin(), out_nbrs.end(), nodes);
-		std::copy(in_nbrs.begin() + bi_deg, in_nbrs.end(), nodes + out_deg);
-		std::sort(nodes, nodes + in_deg + out_deg - bi_deg);
+	std::swap(_likelihood_buf, _likelihood_buf_tmp);
+	std::swap(_likelihood, _likelihood_tmp);
 
-		for (int i = 0; i < bi_deg; ++i)
-		{
-			int v = out_nbrs[i];
-			_affi_out[v][c] = 1.0;
-			_affi_in[v][c] = 1.0;
-		}
+	float *affi_sum = is_out ? _affi_sum_out : _affi_sum_in;
+	float *part = is_out ? _affi_sum_out_part : _affi_sum_in_part;
+	std::copy(affi_sum, affi_sum + _row_size, _affi_sum_tmp);
 
-		for (int i = bi_deg; i < out_deg; ++i)
+	for (; loop < 10; ++loop)
+	{
+		std::fill(part, part + _thread_num * _row_size, 0.0f);
+		_step_alpha = alpha;
+		if (is_out)
 		{
-			int v = out_nbrs[i];
-			_affi_in[v][c] = 1.0;
-			for (int w : _graph.out_neighbors(v))
+			_likelihood = parallel_reduce(0.0f, [this](int node, size_t thread)
 			{
-				if (std::binary_search(nodes, nodes + in_deg + out_deg - bi_deg, w))
-				{
-					_affi_out[v][c] = 1.0;
-					break;
-				}
-			}
+				float *row = _scratch_row + thread * _row_size;
+				_kernel.step_sum(row, _row(_affi_out_data, node), _step_alpha, _affi_out_d[node], _affi_sum_out_part + thread * _row_size, _row_size);
+				_likelihood_buf[node] = _block_likelihood_out(node, row, _node_prods(node, thread));
+				return _likelihood_buf[node];
+			}, std::plus<float>());
+			_merge_affi_sum(affi_sum, part);
 		}
-
-		for (int i = bi_deg; i < in_deg; ++i)
+		else
 		{
-			int v = in_nbrs[i];
-			_affi_out[v][c] = 1.0;
-			for (int w : _graph.in_neighbors(v))
+			parallel_for([this](int node, size_t thread)
 			{
-				if (std::binary_search(nodes, nodes + in_deg + out_deg - bi_deg, w))
-				{
-					_affi_in[v][c] = 1.0;
-					break;
-				}
-			}
+				_kernel.step_sum(_scratch_row + thread * _row_size, _row(_affi_in_data, node), _step_alpha, _affi_in_d[node], _affi_sum_in_part + thread * _row_size, _row_size);
+			});
+			_merge_affi_sum(affi_sum, part);
+			_likelihood = parallel_reduce(0.0f, [this](int node, size_t thread)
+			{
+				_update_node_likelihood_step_in(node, thread);
+				return _likelihood_buf[node];
+			}, std::plus<float>());
 		}
+		float l1 = likelihood(is_train);
 
-		delete[] nodes;
-	}
-	delete[] pairs;
-	_make_affi_sum();
-}
+		printf("alpha = %g, improve = %f\n", alpha, (l0 - l1) / l0);
 
-void affi_directed_model::init_random(unsigned seed)
-{
-	std::default_random_engine engine(seed);
-	std::uniform_real_distribution<float> out_distr(0.0f, 1.0f);
-	std::uniform_real_distribution<float> in_distr(0.0f, 1.0f);
-	int n = _graph.node_num();
-	for (int i = 0; i < n; ++i)
-	{
-		for (int c = 0; c < _cluster_num; ++c)
+		if (l1 > l0 + alpha * cm)
 		{
-			_affi_out[i][c] = out_distr(engine);
-			_affi_in[i][c] = in_distr(engine);
+			_apply_step(is_out);
+			_edge_prod_valid = _edge_prod != nullptr;
+			return alpha;
 		}
+		alpha *= decay;
 	}
-	_make_affi_sum();
+
+	std::swap(_likelihood_buf, _likelihood_buf_tmp);
+	std::swap(_likelihood, _likelihood_tmp);
+	std::copy(_affi_sum_tmp, _affi_sum_tmp + _row_size, affi_sum);
+	_edge_prod_valid = false;
+	_reset_direction(is_out);
+	return 0.0;
 }
 
-void affi_directed_model::_make_affi_sum()
+void affi_directed_model::set_multi_alpha(int alpha_num)
 {
-	std::fill(_affi_sum_out, _affi_sum_out + _cluster_num, 0.0f);
-	std::fill(_affi_sum_in, _affi_sum_in + _cluster_num, 0.0f);
+	_free_multi_alpha();
+	_multi_num = std::min(alpha_num, affi_row_align);
+	if (_multi_num <= 1) return;
+
+	_multi_rows = affi_alloc(_thread_num * _multi_num * _row_size);
+	_multi_buf = new float[(size_t)_graph.node_num() * _multi_num];
+	_multi_sum = affi_alloc(_multi_num * _row_size);
+	_multi_sum_part = affi_alloc(_thread_num * _multi_num * _row_size);
+	// _multi_buf is first written node by node from the workers; the
+	// per-thread candidate rows are cleared one slice per worker.
+	size_t part = (size_t)_multi_num * _row_size;
+	parallel_for_index((int)_thread_num, [this, part](int t, size_t thread) { std::fill(_multi_rows + t * part, _multi_rows + (t + 1) * part, 0.0f); });
+}
 
-	_task_type = _parallel_task_type::task_make_affi_sum;
-	update();
+void affi_directed_model::_free_multi_alpha()
+{
+	affi_free(_multi_rows);
+	delete[] _multi_buf;
+	affi_free(_multi_sum);
+	affi_free(_multi_sum_part);
+	_multi_rows = _multi_buf = nullptr;
+	_multi_sum = _multi_sum_part = nullptr;
+	_multi_num = 0;
+}
 
-	int n = _graph.node_num();
-	for (int c = n; c < _cluster_num; ++c)
+// Cluster sums of the side being updated for every candidate alpha.
+void affi_directed_model::_update_node_multi_sum(int node, size_t thread, bool is_out)
+{
+	const void *row = is_out ? _row(_affi_out_data, node) : _row(_affi_in_data, node);
+	const float *d = is_out ? _affi_out_d[node] : _affi_in_d[node];
+	float *cand = _scratch_row + thread * _row_size;
+	float *part = _multi_sum_part + thread * _multi_num * _row_size;
+	for (int a = 0; a < _multi_num; ++a)
 	{
-		for (int i = 0; i < n; ++i)
-		{
-			_affi_sum_out[c] += _affi_out[i][c];
-			_affi_sum_in[c] += _affi_in[i][c];
-		}
+		_kernel.step_sum(cand, row, _multi_alpha[a], d, part + a * _row_size, _row_size);
 	}
 }
 
-void affi_directed_model::_update_node_make_affi_sum(int c)
+// Likelihood terms of the out-row of node for every candidate out-row; each
+// in-row of a neighbor is read once and used against all candidates.
+void affi_directed_model::_update_node_multi_likelihood_out(int node, size_t thread)
 {
-	if (c >= _cluster_num) return;
-
-	int n = _graph.node_num();
-	for (int i = 0; i < n; ++i)
+	size_t row_stride = _row_size * sizeof(float);
+	char *cands = (char *)(_multi_rows + thread * _multi_num * _row_size);
+	float *sums = _multi_buf + (size_t)node * _multi_num;
+	for (int a = 0; a < _multi_num; ++a)
+	{
+		void *cand = cands + a * row_stride;
+		_kernel.step(cand, _row(_affi_out_data, node), _multi_alpha[a], _affi_out_d[node], _row_size);
+		sums[a] = _kernel.dot(cand, _row(_affi_in_data, node), _row_size) - _kernel.dot_vec(cand, _affi_sum_in, _row_size);
+	}
+	auto out_nbrs = _graph.out_neighbors(node);
+	for (auto nbr = out_nbrs.begin(); nbr != out_nbrs.end(); ++nbr)
 	{
-		_affi_sum_out[c] += _affi_out[i][c];
-		_affi_sum_in[c] += _affi_in[i][c];
+		int v = *nbr;
+		_prefetch_row(_affi_in_data, nbr, out_nbrs.end());
+		for (int a = 0; a < _multi_num; ++a)
+		{
+			float affi_prod_sum = _kernel.dot(cands + a * row_stride, _row(_affi_in_data, v), _row_size);
+			float p = std::max(-expm1(-affi_prod_sum), _background_prob);
+			sums[a] += affi_prod_sum + log(p);
+		}
 	}
+	if (_multi_used != nullptr && !_multi_used[node]) return;
+	float *sum = _thread_sum + thread * affi_row_align;
+	for (int a = 0; a < _multi_num; ++a) sum[a] += sums[a];
 }
 
-void affi_directed_model::_update_node_likelihood(int node)
+// Same for the in-candidates, which are formed per edge from row + alpha * d
+// as in the low-memory search; _multi_sum holds their cluster sums.
+void affi_directed_model::_update_node_multi_likelihood_in(int node, size_t thread)
 {
-	auto out_nbrs = _graph.out_neighbors(node);
-	float sum = 0.0;
-	for (int c = 0; c < _cluster_num; ++c)
+	const void *row = _row(_affi_out_data, node);
+	float *sums = _multi_buf + (size_t)node * _multi_num;
+	for (int a = 0; a < _multi_num; ++a)
 	{
-		sum -= _affi_out[node][c] * (_affi_sum_in[c] - _affi_in[node][c]);
+		sums[a] = _kernel.dot_step(row, _row(_affi_in_data, node), _multi_alpha[a], _affi_in_d[node], _row_size) - _kernel.dot_vec(row, _multi_sum + a * _row_size, _row_size);
 	}
-	for (int v : out_nbrs)
+	auto out_nbrs = _graph.out_neighbors(node);
+	for (auto nbr = out_nbrs.begin(); nbr != out_nbrs.end(); ++nbr)
 	{
-		float affi_prod_sum = 0.0;
-		for (int c = 0; c < _cluster_num; ++c)
+		int v = *nbr;
+		_prefetch_row(_affi_in_data, nbr, out_nbrs.end());
+		for (int a = 0; a < _multi_num; ++a)
 		{
-			affi_prod_sum += _affi_out[node][c] * _affi_in[v][c];
+			float affi_prod_sum = _kernel.dot_step(row, _row(_affi_in_data, v), _multi_alpha[a], _affi_in_d[v], _row_size);
+			float p = std::max(-expm1(-affi_prod_sum), _background_prob);
+			sums[a] += affi_prod_sum + log(p);
 		}
-		sum += affi_prod_sum;
-		float p = std::max(-expm1(-affi_prod_sum), _background_prob);
-		sum += log(p);
 	}
-	_likelihood_buf[node] = sum;
+	if (_multi_used != nullptr && !_multi_used[node]) return;
+	float *sum = _thread_sum + thread * affi_row_align;
+	for (int a = 0; a < _multi_num; ++a) sum[a] += sums[a];
 }
 
-float affi_directed_model::likelihood()
+// Runs the first _multi_num steps of the backtracking search in one sweep
+// and applies the first candidate that passes; rows, sums and likelihood are
+// left untouched when none does.
+float affi_directed_model::_multi_step(bool is_out, float alpha, float decay, float l0, float cm, bool *is_train)
 {
-	if (_likelihood <= 0.0) return _likelihood;
-	_task_type = _parallel_task_type::task_likelihood;
-	update();
-	_likelihood = 0.0;
-	int n = _graph.node_num();
-	for (int i = 0; i < n; ++i)
+	for (int a = 0; a < _multi_num; ++a, alpha *= decay) _multi_alpha[a] = alpha;
+
+	std::fill(_multi_sum_part, _multi_sum_part + _thread_num * _multi_num * _row_size, 0.0f);
+	parallel_for([this, is_out](int node, size_t thread) { _update_node_multi_sum(node, thread, is_out); });
+	std::fill(_multi_sum, _multi_sum + _multi_num * _row_size, 0.0f);
+	for (size_t t = 0; t < _thread_num; ++t)
 	{
-		_likelihood += _likelihood_buf[i];
+		const float *p = _multi_sum_part + t * _multi_num * _row_size;
+		for (int c = 0; c < _multi_num * _row_size; ++c) _multi_sum[c] += p[c];
 	}
-	return _likelihood;
+
+	_multi_used = is_train;
+	if (is_out) _update_reduce([this](int node, size_t thread) { _update_node_multi_likelihood_out(node, thread); });
+	else _update_reduce([this](int node, size_t thread) { _update_node_multi_likelihood_in(node, thread); });
+
+	for (int a = 0; a < _multi_num; ++a)
+	{
+		float l1 = _thread_total(a);
+
+		printf("alpha = %g, improve = %f\n", _multi_alpha[a], (l0 - l1) / l0);
+
+		if (l1 <= l0 + _multi_alpha[a] * cm) continue;
+
+		_step_alpha = _multi_alpha[a];
+		_apply_step(is_out);
+		float *affi_sum = is_out ? _affi_sum_out : _affi_sum_in;
+		std::copy(_multi_sum + a * _row_size, _multi_sum + (a + 1) * _row_size, affi_sum);
+
+		int n = _graph.node_num();
+		_likelihood = 0.0f;
+		for (int i = 0; i < n; ++i)
+		{
+			_likelihood_buf[i] = _multi_buf[(size_t)i * _multi_num + a];
+			_likelihood += _likelihood_buf[i];
+		}
+		_edge_prod_valid = false;
+		return _multi_alpha[a];
+	}
+	return 0.0;
 }
 
-float affi_directed_model::likelihood(int node)
+// Given the in-affinities, the likelihood splits into independent terms per
+// out-row (and vice versa), so each node can run its own backtracking line
+// search against the current cluster sums without touching other rows.
+float affi_directed_model::_block_likelihood_out(int node, const void *row, float *prods)
 {
-	likelihood();
-	return _likelihood_buf[node];
+	float sum = _kernel.dot(row, _row(_affi_in_data, node), _row_size) - _kernel.dot_vec(row, _affi_sum_in, _row_size);
+	auto out_nbrs = _graph.out_neighbors(node);
+	for (auto nbr = out_nbrs.begin(); nbr != out_nbrs.end(); ++nbr)
+	{
+		int v = *nbr;
+		_prefetch_row(_affi_in_data, nbr, out_nbrs.end());
+		float affi_prod_sum = _kernel.dot(row, _row(_affi_in_data, v), _row_size);
+		if (prods != nullptr) *prods++ = affi_prod_sum;
+		sum += affi_prod_sum;
+		float p = std::max(-expm1(-affi_prod_sum), _background_prob);
+		sum += log(p);
+	}
+	return sum;
 }
 
-float affi_directed_model::likelihood(bool *used)
+// The terms of an in-row are spread over the likelihood of its source nodes;
+// with used only those of the nodes in used are counted, and sum_out is the
+// sum of their out-rows.
+float affi_directed_model::_block_likelihood_in(int node, const void *row, const float *sum_out, const bool *used)
 {
-	likelihood();
-	if (used == NULL) return _likelihood;
-	float sum = 0.0;
-	int n = _graph.node_num();
-	for (int i = 0; i < n; ++i)
+	float sum = -_kernel.dot_vec(row, sum_out, _row_size);
+	if (used == nullptr || used[node]) sum += _kernel.dot(_row(_affi_out_data, node), row, _row_size);
+	auto in_nbrs = _graph.in_neighbors(node);
+	for (auto nbr = in_nbrs.begin(); nbr != in_nbrs.end(); ++nbr)
 	{
-		if (used[i]) sum += _likelihood_buf[i];
+		int u = *nbr;
+		_prefetch_row(_affi_out_data, nbr, in_nbrs.end());
+		if (used != nullptr && !used[u]) continue;
+		float affi_prod_sum = _kernel.dot(_row(_affi_out_data, u), row, _row_size);
+		sum += affi_prod_sum;
+		float p = std::max(-expm1(-affi_prod_sum), _background_prob);
+		sum += log(p);
 	}
 	return sum;
 }
 
-void affi_directed_model::_update_node_gradient_out(int node)
+// The out-row of a node only enters its own likelihood terms, so out-rows of
+// nodes outside _block_train are left as they are.
+void affi_directed_model::_update_node_block_out(int node, size_t thread)
 {
-	for (int c = 0; c < _cluster_num; ++c)
+	if (_block_train != nullptr && !_block_train[node])
 	{
-		_affi_out_d[node][c] = _affi_in[node][c] - _affi_sum_in[c];
+		_update_node_likelihood(node, thread);
+		return;
 	}
-	auto out_nbrs = _graph.out_neighbors(node);
-	for (int v : out_nbrs)
+	_update_node_likelihood_gradient_out(node, thread);
+
+	void *row = _row(_affi_out_data, node);
+	float *d = _affi_out_d[node];
+	float *cand = _scratch_row + thread * _row_size;
+	float *prods = _node_prods(node, thread);
+	float l0 = _likelihood_buf[node];
+	float m = _kernel.norm(d, _row_size);
+	if (m <= 0.0f) return;
+	float cm = m * _block_scale;
+	float alpha = _block_alpha / sqrt(m);
+
+	for (int loop = 0; loop < 10; ++loop)
 	{
-		float affi_prod_sum = 0.0;
-		for (int c = 0; c < _cluster_num; ++c)
-		{
-			affi_prod_sum += _affi_out[node][c] * _affi_in[v][c];
-		}
-		float p = std::max(-expm1(-affi_prod_sum), _background_prob);
-		for (int c = 0; c < _cluster_num; ++c)
+		_kernel.step(cand, row, alpha, d, _row_size);
+		float l1 = _block_likelihood_out(node, cand, prods);
+		if (l1 > l0 + alpha * cm)
 		{
-			_affi_out_d[node][c] += _affi_in[v][c] / p;
+			memcpy(row, cand, _row_bytes);
+			_likelihood_buf[node] = l1;
+			return;
 		}
+		alpha *= _block_decay;
 	}
+	_block_likelihood_out(node, row, prods);
 }
 
-void affi_directed_model::_update_node_gradient_in(int node)
+// Gradient of the in-row of node into _affi_in_d[node]; returns the terms of
+// the likelihood that depend on that row, restricted to used as in
+// _block_likelihood_in.
+float affi_directed_model::_update_node_likelihood_gradient_in(int node, const float *sum_out, const bool *used)
 {
-	for (int c = 0; c < _cluster_num; ++c)
+	const void *row = _row(_affi_in_data, node);
+	float *d = _affi_in_d[node];
+	float sum = -_kernel.dot_vec(row, sum_out, _row_size);
+	if (used == nullptr || used[node])
+	{
+		_kernel.sub(d, _row(_affi_out_data, node), sum_out, _row_size);
+		sum += _kernel.dot(_row(_affi_out_data, node), row, _row_size);
+	}
+	else
 	{
-		_affi_in_d[node][c] = _affi_out[node][c] - _affi_sum_out[c];
+		for (int c = 0; c < _row_size; ++c) d[c] = -sum_out[c];
 	}
 	auto in_nbrs = _graph.in_neighbors(node);
-	for (int u : in_nbrs)
+	for (auto nbr = in_nbrs.begin(); nbr != in_nbrs.end(); ++nbr)
 	{
-		float affi_prod_sum = 0.0;
-		for (int c = 0; c < _cluster_num; ++c)
-		{
-			affi_prod_sum += _affi_out[u][c] * _affi_in[node][c];
-		}
+		int u = *nbr;
+		_prefetch_row(_affi_out_data, nbr, in_nbrs.end());
+		if (used != nullptr && !used[u]) continue;
+		float affi_prod_sum = _kernel.dot(_row(_affi_out_data, u), row, _row_size);
+		sum += affi_prod_sum;
 		float p = std::max(-expm1(-affi_prod_sum), _background_prob);
-		for (int c = 0; c < _cluster_num; ++c)
-		{
-			_affi_in_d[node][c] += _affi_out[u][c] / p;
-		}
+		sum += log(p);
+		_kernel.axpy(d, 1.0f / p, _row(_affi_out_data, u), _row_size);
 	}
+	return sum;
 }
 
-void affi_directed_model::_make_gradient_out()
-{
-	_task_type = _parallel_task_type::task_gradient_out;
-	update();
-}
-
-void affi_directed_model::_make_gradient_in()
+void affi_directed_model::_update_node_block_in(int node, size_t thread)
 {
-	_task_type = _parallel_task_type::task_gradient_in;
-	update();
-}
+	void *row = _row(_affi_in_data, node);
+	float *d = _affi_in_d[node];
+	float *cand = _scratch_row + thread * _row_size;
+	float l0 = _update_node_likelihood_gradient_in(node, _block_sum_out, _block_train);
 
-float affi_directed_model::iterate_out(float alpha, float scale, float decay, bool *is_train)
-{
-	float l0 = likelihood(is_train);
-	_make_gradient_out();
-	std::swap(_affi_out, _affi_out_tmp);
-	std::swap(_likelihood_buf, _likelihood_buf_tmp);
-	std::swap(_likelihood, _likelihood_tmp);
-	int n = _graph.node_num();
+	float m = _kernel.norm(d, _row_size);
+	if (m <= 0.0f) return;
+	float cm = m * _block_scale;
+	float alpha = _block_alpha / sqrt(m);
 
-	float m = 0.0;
-	for (int i = 0; i < n; ++i)
+	for (int loop = 0; loop < 10; ++loop)
 	{
-		for (int c = 0; c < _cluster_num; ++c)
+		_kernel.step(cand, row, alpha, d, _row_size);
+		float l1 = _block_likelihood_in(node, cand, _block_sum_out, _block_train);
+		if (l1 > l0 + alpha * cm)
 		{
-			m += _affi_out_d[i][c] * _affi_out_d[i][c];
+			memcpy(row, cand, _row_bytes);
+			return;
 		}
+		alpha *= _block_decay;
 	}
-	float cm = m * scale;
-	alpha /= sqrt(m);
+}
 
-	printf("alpha = %g, m = %f, cm = %f\n", alpha, m, cm);
+void affi_directed_model::iterate_block_out(float alpha, float scale, float decay, bool *is_train)
+{
+	_block_alpha = alpha;
+	_block_scale = scale;
+	_block_decay = decay;
+	_block_train = is_train;
+	_lbfgs_side = -1;
+	std::fill(_affi_sum_out_part, _affi_sum_out_part + _thread_num * _row_size, 0.0f);
+	_likelihood = parallel_reduce(0.0f, [this](int node, size_t thread)
+	{
+		_update_node_block_out(node, thread);
+		_kernel.axpy(_affi_sum_out_part + thread * _row_size, 1.0f, _row(_affi_out_data, node), _row_size);
+		return _likelihood_buf[node];
+	}, std::plus<float>());
+	_merge_affi_sum(_affi_sum_out, _affi_sum_out_part);
+	_edge_prod_valid = _edge_prod != nullptr;
+}
 
-	//while (alpha > 1e-6)
-	for (int loop = 0; loop < 10; ++loop)
+void affi_directed_model::iterate_block_in(float alpha, float scale, float decay, bool *is_train)
+{
+	_block_alpha = alpha;
+	_block_scale = scale;
+	_block_decay = decay;
+	_block_train = is_train;
+	_block_sum_out = _affi_sum_out;
+	_lbfgs_side = -1;
+	if (is_train != nullptr)
 	{
-		for (int i = 0; i < n; ++i)
+		std::fill(_affi_sum_out_part, _affi_sum_out_part + _thread_num * _row_size, 0.0f);
+		parallel_for([this, is_train](int node, size_t thread)
 		{
-			for (int c = 0; c < _cluster_num; ++c)
-			{
-				_affi_out[i][c] = std::max(0.0f, _affi_out_tmp[i][c] + alpha * _affi_out_d[i][c]);
-			}
-		}
+			if (is_train[node]) _kernel.axpy(_affi_sum_out_part + thread * _row_size, 1.0f, _row(_affi_out_data, node), _row_size);
+		});
+		_merge_affi_sum(_affi_sum_tmp, _affi_sum_out_part);
+		_block_sum_out = _affi_sum_tmp;
+	}
+	std::fill(_affi_sum_in_part, _affi_sum_in_part + _thread_num * _row_size, 0.0f);
+	parallel_for([this](int node, size_t thread)
+	{
+		_update_node_block_in(node, thread);
+		_kernel.axpy(_affi_sum_in_part + thread * _row_size, 1.0f, _row(_affi_in_data, node), _row_size);
+	});
+	_merge_affi_sum(_affi_sum_in, _affi_sum_in_part);
+	_edge_prod_valid = false;
+	_likelihood = 1.0;
+}
 
-		_make_affi_sum();
-		_likelihood = 1.0;
-		float l1 = likelihood(is_train);
+// Moves row by a step of length _sgd_lr along d and records the change of
+// the cluster sum in part.
+void affi_directed_model::_sgd_step(void *row, const float *d, float *part)
+{
+	float m = _kernel.norm(d, _row_size);
+	if (m <= 0.0f) return;
+	_kernel.axpy(part, -1.0f, row, _row_size);
+	_kernel.step(row, row, _sgd_lr / sqrt(m), d, _row_size);
+	_kernel.axpy(part, 1.0f, row, _row_size);
+}
 
-		printf("alpha = %g, improve = %f\n", alpha, (l0 - l1) / l0);
+void affi_directed_model::_update_node_sgd_out(int node, size_t thread)
+{
+	_update_node_likelihood_gradient_out(node, thread);
+	_sgd_step(_row(_affi_out_data, node), _affi_out_d[node], _affi_sum_out_part + thread * _row_size);
+}
 
-		if (l1 > l0 + alpha * cm) return alpha;
-		alpha *= decay;
-	}
+void affi_directed_model::_update_node_sgd_in(int node, size_t thread)
+{
+	_update_node_likelihood_gradient_in(node, _affi_sum_out, nullptr);
+	_sgd_step(_row(_affi_in_data, node), _affi_in_d[node], _affi_sum_in_part + thread * _row_size);
+}
 
-	std::swap(_affi_out, _affi_out_tmp);
-	std::swap(_likelihood_buf, _likelihood_buf_tmp);
-	std::swap(_likelihood, _likelihood_tmp);
-	_make_affi_sum();
-	return 0.0;
+// The gradients use the shared sums of the last merge; subtracting the
+// thread's own delta makes them see its earlier steps of this epoch.
+void affi_directed_model::_update_node_async(int node, size_t thread)
+{
+	float *part_out = _affi_sum_out_part + thread * _row_size;
+	float *part_in = _affi_sum_in_part + thread * _row_size;
+
+	_update_node_likelihood_gradient_out(node, thread);
+	float *d = _affi_out_d[node];
+	for (int c = 0; c < _row_size; ++c) d[c] -= part_in[c];
+	_sgd_step(_row(_affi_out_data, node), d, part_out);
+
+	_update_node_likelihood_gradient_in(node, _affi_sum_out, nullptr);
+	d = _affi_in_d[node];
+	for (int c = 0; c < _row_size; ++c) d[c] -= part_out[c];
+	_sgd_step(_row(_affi_in_data, node), d, part_in);
 }
 
-float affi_directed_model::iterate_in(float alpha, float scale, float decay, bool *is_train)
+float affi_directed_model::converge_sgd(float lr, float decay, int batch_size, bool *is_train, float rel_improve, unsigned seed, int max_epoch)
 {
-	float l0 = likelihood(is_train);
-	_make_gradient_in();
-	std::swap(_affi_in, _affi_in_tmp);
-	std::swap(_likelihood_buf, _likelihood_buf_tmp);
-	std::swap(_likelihood, _likelihood_tmp);
 	int n = _graph.node_num();
+	int *order = new int[n];
+	for (int i = 0; i < n; ++i) order[i] = i;
+	std::default_random_engine engine(seed);
 
-	float m = 0.0;
-	for (int i = 0; i < n; ++i)
+	float l0 = likelihood(is_train);
+	float l1 = l0;
+	_sgd_lr = lr;
+	_lbfgs_side = -1;
+	for (int epoch = 0; epoch < max_epoch; ++epoch)
 	{
-		for (int c = 0; c < _cluster_num; ++c)
+		std::shuffle(order, order + n, engine);
+		for (int start = 0; start < n; start += batch_size)
 		{
-			m += _affi_in_d[i][c] * _affi_in_d[i][c];
+			_batch_nodes = order + start;
+			int num = std::min(batch_size, n - start);
+
+			std::fill(_affi_sum_out_part, _affi_sum_out_part + _thread_num * _row_size, 0.0f);
+			parallel_for_index(num, [this](int node, size_t thread) { _update_node_sgd_out(_batch_nodes[node], thread); });
+			_add_affi_sum(_affi_sum_out, _affi_sum_out_part);
+
+			std::fill(_affi_sum_in_part, _affi_sum_in_part + _thread_num * _row_size, 0.0f);
+			parallel_for_index(num, [this](int node, size_t thread) { _update_node_sgd_in(_batch_nodes[node], thread); });
+			_add_affi_sum(_affi_sum_in, _affi_sum_in_part);
 		}
+		_edge_prod_valid = false;
+		_likelihood = 1.0;
+
+		float l2 = likelihood(is_train);
+		float r = (l1 - l2) / l1;
+		printf("Epoch %d: likelihood = %f, improve = %f\n", epoch, l2, r);
+		l1 = l2;
+		if (r < rel_improve) break;
+		_sgd_lr *= decay;
 	}
-	float cm = m * scale;
-	alpha /= sqrt(m);
+	printf("\n");
+	delete[] order;
+	return (l0 - l1) / l0;
+}
 
-	printf("alpha = %g, m = %f, cm = %f\n", alpha, m, cm);
+float affi_directed_model::converge_async(float lr, float decay, bool *is_train, float rel_improve, unsigned seed, int max_epoch)
+{
+	int n = _graph.node_num();
+	int *order = new int[n];
+	for (int i = 0; i < n; ++i) order[i] = i;
+	std::default_random_engine engine(seed);
 
-	//while (alpha > 1e-6)
-	for (int loop = 0; loop < 10; ++loop)
+	float l0 = likelihood(is_train);
+	float l1 = l0;
+	_sgd_lr = lr;
+	_lbfgs_side = -1;
+	_batch_nodes = order;
+	for (int epoch = 0; epoch < max_epoch; ++epoch)
 	{
-		for (int i = 0; i < n; ++i)
-		{
-			for (int c = 0; c < _cluster_num; ++c)
-			{
-				_affi_in[i][c] = std::max(0.0f, _affi_in_tmp[i][c] + alpha * _affi_in_d[i][c]);
-			}
-		}
-
-		_make_affi_sum();
+		std::shuffle(order, order + n, engine);
+		std::fill(_affi_sum_out_part, _affi_sum_out_part + _thread_num * _row_size, 0.0f);
+		std::fill(_affi_sum_in_part, _affi_sum_in_part + _thread_num * _row_size, 0.0f);
+		parallel_for_index(_graph.node_num(), [this](int node, size_t thread) { _update_node_async(_batch_nodes[node], thread); });
+		_add_affi_sum(_affi_sum_out, _affi_sum_out_part);
+		_add_affi_sum(_affi_sum_in, _affi_sum_in_part);
+		_edge_prod_valid = false;
 		_likelihood = 1.0;
-		float l1 = likelihood(is_train);
 
-		printf("alpha = %g, improve = %f\n", alpha, (l0 - l1) / l0);
+		float l2 = likelihood(is_train);
+		float r = (l1 - l2) / l1;
+		printf("Epoch %d: likelihood = %f, improve = %f\n", epoch, l2, r);
+		l1 = l2;
+		if (r < rel_improve) break;
+		_sgd_lr *= decay;
+	}
+	printf("\n");
+	delete[] order;
+	return (l0 - l1) / l0;
+}
 
-		if (l1 > l0 + alpha * cm) return alpha;
-		alpha *= decay;
+float affi_directed_model::converge_block(float alpha, float scale, float decay, bool *is_train, float rel_improve)
+{
+	float l0 = likelihood(is_train);
+	for (int loop = 0; loop < 1000; ++loop)
+	{
+		float l1 = likelihood(is_train);
+		iterate_block_in(alpha, scale, decay, is_train);
+		iterate_block_out(alpha, scale, decay, is_train);
+		float l2 = likelihood(is_train);
+		float r = (l1 - l2) / l1;
+		printf("Loop %d: likelihood = %f, improve = %f\n", loop, l2, r);
+		if (r < rel_improve) break;
 	}
+	printf("\n");
+	float l1 = likelihood(is_train);
+	return (l0 - l1) / l0;
+}
 
-	std::swap(_affi_in, _affi_in_tmp);
-	std::swap(_likelihood_buf, _likelihood_buf_tmp);
-	std::swap(_likelihood, _likelihood_tmp);
-	_make_affi_sum();
-	return 0.0;
+void affi_directed_model::_affinity(const void *data, int node, float *row, float *buf) const
+{
+	float *local = buf == nullptr ? affi_alloc(_row_size) : buf;
+	_kernel.load(local, _row(data, node), _row_size);
+	std::copy(local, local + _cluster_num, row);
+	if (buf == nullptr) affi_free(local);
 }
 
-float **affi_directed_model::affinity_out()
+void affi_directed_model::affinity_out(int node, float *row, float *buf) const
 {
-	return _affi_out;
+	_affinity(_affi_out_data, node, row, buf);
 }
 
-float **affi_directed_model::affinity_in()
+void affi_directed_model::affinity_in(int node, float *row, float *buf) const
 {
-	return _affi_in;
+	_affinity(_affi_in_data, node, row, buf);
 }
 
 float affi_directed_model::argmin_out(float alpha, float scale, float decay, bool *is_train, float rel_improve)
@@ -658,6 +1585,25 @@ float affi_directed_model::converge(float alpha, float scale, float decay, bool
 	return (l0 - l1) / l0;
 }
 
+float affi_directed_model::converge_joint(float alpha, float scale, float decay, bool *is_train, float rel_improve)
+{
+	printf("converge_joint: ");
+	float l0 = likelihood(is_train);
+	for (int loop = 0;; ++loop)
+	{
+		printf(".");
+		float l1 = likelihood(is_train);
+		float step = iterate_joint(alpha, scale, decay, is_train);
+		float l2 = likelihood(is_train);
+		if (step == 0.0) break;
+		float r = (l1 - l2) / l1;
+		if (r < rel_improve) break;
+	}
+	printf("\n");
+	float l1 = likelihood(is_train);
+	return (l0 - l1) / l0;
+}
+
 int affi_directed_model::node_num()
 {
 	return _graph.node_num();
@@ -667,3 +1613,8 @@ int affi_directed_model::cluster_num()
 {
 	return _cluster_num;
 }
+
+int affi_directed_model::row_size()
+{
+	return _row_size;
+}
@@ -2,22 +2,70 @@
 
 #include "graph/graph.h"
 #include "graph/algorithm/base.h"
+#include "affi_kernel.h"
+#include "affi_seed.h"
+#include "affi_optimizer.h"
+
+// Rows longer than affi_tile_threshold entries are processed in tiles of
+// affi_tile_size entries by the edge loops, see set_cluster_tile.
+const int affi_tile_threshold = 1024;
+const int affi_tile_size = 512;
 
 class affi_directed_model : public graph::parallel_algo<graph::directed_graph<int, char *>>
 {
 public:
 	typedef graph::directed_graph<int, char *> graph_t;
 
-	affi_directed_model(graph_t &g, int cluster_num, size_t thread_num);
+	// With low_memory the model keeps three n x K buffers instead of six: the
+	// gradient buffer is shared by both directions and line-search candidates
+	// are evaluated on the fly from row + alpha * d, then applied in place.
+	// storage selects the element type of the affinity rows; gradients and
+	// cluster sums are fp32 in every mode. The n x K buffers are zeroed by
+	// the workers, each on the nodes it updates, so with pin_threads their
+	// pages are placed on the socket of the thread that owns the rows; call
+	// g.first_touch(model) to do the same for the edge lists.
+	affi_directed_model(graph_t &g, int cluster_num, size_t thread_num, bool low_memory = false, affi_storage storage = affi_storage::fp32, bool pin_threads = false);
 	~affi_directed_model();
 
 	int node_num();
 	int cluster_num();
+	// Length of a padded row, cluster_num() rounded up to affi_row_align.
+	int row_size();
 
 	void init_neighborhood(bool *is_seed);
 	void init_min_neighborhood(bool *is_seed = nullptr);
 	void init_random(unsigned seed);
-	void update_node(int node);
+
+	// Shapes the gradient of iterate_out/iterate_in (and so argmin_* and
+	// converge) before the line search; nullptr restores plain projected
+	// gradient. The optimizer is not owned by the model.
+	void set_optimizer(affi_optimizer *optimizer);
+
+	// Projected L-BFGS for the out and in subproblems: the last history
+	// (s, y) pairs of the side being optimized shape the gradient through the
+	// two-loop recursion, on the coordinates not held at zero. Quasi-Newton
+	// steps start the line search at alpha = 1 instead of the caller's alpha,
+	// which is still used for the first gradient step of each subproblem.
+	// Needs 2 * history + 2 buffers of n x K floats. Takes precedence over
+	// set_optimizer; 0 turns it off.
+	void set_lbfgs(int history);
+
+	// Evaluates the first alpha_num backtracking steps alpha, alpha * decay,
+	// ... of iterate_out/iterate_in in one pass over the edges and takes the
+	// largest that passes the sufficient-increase test; the serial search
+	// continues from there if none does. At most affi_row_align; 0 or 1 turns
+	// it off.
+	void set_multi_alpha(int alpha_num);
+
+	// Splits the K dimension of the likelihood and gradient edge loops into
+	// tiles of tile_size entries (rounded up to affi_row_align): all edge
+	// dot products are accumulated tile by tile first, then the gradient is
+	// built tile by tile from them. 0 turns tiling off.
+	void set_cluster_tile(int tile_size);
+
+	// The edge loops prefetch the row of the neighbour distance entries ahead
+	// of the one being processed. 0 turns prefetching off.
+	void set_prefetch_distance(int distance);
 
 	float iterate_out(float alpha = 1.0, float scale = 1e-4, float decay = 0.5, bool *is_train = nullptr);
 	float iterate_in(float alpha = 1.0, float scale = 1e-4, float decay = 0.5, bool *is_train = nullptr);
@@ -27,42 +75,163 @@ public:
 
 	float converge(float alpha = 1.0, float scale = 1e-4, float decay = 0.5, bool *is_train = nullptr, float rel_improve = 1e-4);
 
+	// Steps both matrices at once along their plain projected gradients,
+	// with a single line search over the joint step. The in-gradient reuses
+	// the edge products of the out pass, so each edge costs one dot product.
+	// Falls back to iterate_out then iterate_in, which honour them, when an
+	// optimizer, L-BFGS or multi-alpha is set, and in low-memory mode, which
+	// keeps one gradient buffer only. Cluster tiling applies as in
+	// iterate_out/iterate_in.
+	float iterate_joint(float alpha = 1.0, float scale = 1e-4, float decay = 0.5, bool *is_train = nullptr);
+	float converge_joint(float alpha = 1.0, float scale = 1e-4, float decay = 0.5, bool *is_train = nullptr, float rel_improve = 1e-4);
+
+	// Block coordinate ascent: every node runs its own line search on its
+	// out-row (in-row) against the current cluster sums. With is_train the
+	// searches count only the likelihood terms of the nodes in is_train, and
+	// the out-rows of the other nodes are left as they are.
+	void iterate_block_out(float alpha = 1.0, float scale = 1e-4, float decay = 0.5, bool *is_train = nullptr);
+	void iterate_block_in(float alpha = 1.0, float scale = 1e-4, float decay = 0.5, bool *is_train = nullptr);
+
+	float converge_block(float alpha = 1.0, float scale = 1e-4, float decay = 0.5, bool *is_train = nullptr, float rel_improve = 1e-4);
+
+	// Mini-batch projected SGD. Each batch moves the out-rows and then the
+	// in-rows of a random node subset by a gradient step of length lr, which
+	// is multiplied by decay after every epoch; the cluster sums are kept
+	// exact from the row deltas, so the non-edge term needs no sampling. The
+	// full likelihood is evaluated once per epoch.
+	float converge_sgd(float lr = 0.1, float decay = 1.0, int batch_size = 4096, bool *is_train = nullptr, float rel_improve = 1e-4, unsigned seed = 0, int max_epoch = 100);
+
+	// Hogwild variant of converge_sgd: one pass per epoch in which every
+	// worker steps the out-row and then the in-row of its nodes in place,
+	// reading whatever the other workers have written so far. Cluster sum
+	// changes go to per-thread deltas, which each worker adds to its own
+	// view and which are merged into the shared sums at the end of the epoch.
+	float converge_async(float lr = 0.1, float decay = 1.0, bool *is_train = nullptr, float rel_improve = 1e-4, unsigned seed = 0, int max_epoch = 100);
+
 	float likelihood();
 	float likelihood(int node);
 	float likelihood(bool *used);
 
-	float **affinity_out();
-	float **affinity_in();
+	// Copy the cluster_num() affinities of node into row. Rows are decoded
+	// through buf, row_size() floats from affi_alloc, or through a buffer of
+	// their own if buf is nullptr, so they can be called concurrently.
+	void affinity_out(int node, float *row, float *buf = nullptr) const;
+	void affinity_in(int node, float *row, float *buf = nullptr) const;
 
 private:
-	int _cluster_num;
+	const affi_kernel &_kernel, &_tile_kernel;
+	int _cluster_num, _row_size, _tile_size, _prefetch_distance;
+	size_t _row_bytes;
 	float _background_prob;
-	float **_affi_out, *_affi_out_data;
-	float **_affi_out_tmp, *_affi_out_tmp_data;
+	void *_affi_out_data, *_affi_out_tmp_data;
 	float **_affi_out_d, *_affi_out_d_data;
-	float **_affi_in, *_affi_in_data;
-	float **_affi_in_tmp, *_affi_in_tmp_data;
+	void *_affi_in_data, *_affi_in_tmp_data;
 	float **_affi_in_d, *_affi_in_d_data;
 	float *_affi_sum_out, *_affi_sum_in;
+	float *_affi_sum_out_part, *_affi_sum_in_part;
+	float *_affi_sum_tmp;
+	float *_scratch_row;
+	bool _low_memory;
+
+	int *_batch_nodes;
+	float _sgd_lr;
+
+	affi_optimizer *_optimizer;
+
+	int _lbfgs_size, _lbfgs_count, _lbfgs_head, _lbfgs_side;
+	float **_lbfgs_s, **_lbfgs_y;
+	float *_lbfgs_rho, *_lbfgs_a, _lbfgs_gamma;
+	float *_lbfgs_x, *_lbfgs_g;
+	const float *_lbfgs_axpy, *_lbfgs_dot;
+	float _lbfgs_coef, _lbfgs_gain;
+
+	int _multi_num;
+	float _multi_alpha[affi_row_align];
+	float *_multi_rows, *_multi_buf;
+	float *_multi_sum, *_multi_sum_part;
+	bool *_multi_used;
 
 	float *_likelihood_buf, *_likelihood_buf_tmp;
 	float _likelihood, _likelihood_tmp;
-	float *_conductance_tmp;
 
-	enum _parallel_task_type
-	{
-		task_gradient_out, task_gradient_in, task_min_neighborhood, task_likelihood, task_edge_prob, task_make_affi_sum
-	};
-	_parallel_task_type _task_type;
+	float *_edge_prod;
+	int *_in_edge_rank;
+	bool _edge_prod_valid;
+	float *_tile_prods;
+	int _max_out_degree;
+
+	float _block_alpha, _block_scale, _block_decay;
+	bool *_block_train;
+	const float *_block_sum_out;
+	float _step_alpha;
+	float *_thread_sum;
 
 	void _update_node_gradient_out(int node);
 	void _update_node_gradient_in(int node);
-	void _update_node_min_neighborhood(int node);
-	void _update_node_likelihood(int node);
-	void _update_node_make_affi_sum(int c);
-
+	void _update_node_likelihood(int node, size_t thread);
+	void _update_node_make_affi_sum(int node, size_t thread);
+	void _update_node_likelihood_gradient_out(int node, size_t thread);
+	float _update_node_likelihood_gradient_in(int node, const float *sum_out, const bool *used);
+	void _update_node_edge_rank(int node);
+	void _alloc_edge_cache();
+	float *_node_prods(int node, size_t thread);
+	void _update_node_clear(int node);
+	void _update_node_clear_lbfgs(int node);
+	void _update_node_block_out(int node, size_t thread);
+	void _update_node_block_in(int node, size_t thread);
+	void _update_node_likelihood_step_in(int node, size_t thread);
+	void _update_node_sgd_out(int node, size_t thread);
+	void _update_node_sgd_in(int node, size_t thread);
+	void _update_node_async(int node, size_t thread);
+	void _sgd_step(void *row, const float *d, float *part);
+	void _update_node_direction(int node, size_t thread, bool is_out);
+	void _update_node_lbfgs_pair(int node, size_t thread);
+	void _update_node_lbfgs_pass(int node, size_t thread);
+	void _update_node_lbfgs_final(int node, size_t thread);
+	void _update_node_multi_sum(int node, size_t thread, bool is_out);
+	void _update_node_multi_likelihood_out(int node, size_t thread);
+	void _update_node_multi_likelihood_in(int node, size_t thread);
+
+	void _init_seeds(affi_seed &seed, int *seeds, int m);
 	void _make_affi_sum();
+	void _merge_affi_sum(float *sum, const float *part);
+	void _add_affi_sum(float *sum, const float *part);
+	void _make_step(bool is_out, float alpha);
+	void _apply_step(bool is_out);
 	void _make_gradient_out();
 	void _make_gradient_in();
+	template <class Func> float _update_reduce(const Func &fn);
+	float _gradient_norm(bool is_out);
+	float _thread_total(int slot);
+	float _make_direction(bool is_out, float &alpha);
+	bool _make_lbfgs_direction(bool is_out, float *slope);
+	template <class Func> float _lbfgs_pass(const Func &fn, const float *axpy, float coef, float gain, const float *dot);
+	void _free_lbfgs();
+	void _reset_direction(bool is_out);
+	void _reset_optimizer(bool is_out);
+	void _free_multi_alpha();
+	float _multi_step(bool is_out, float alpha, float decay, float l0, float cm, bool *is_train);
+	float _iterate_low_memory(bool is_out, float alpha, float scale, float decay, bool *is_train);
+	float _block_likelihood_out(int node, const void *row, float *prods);
+	float _block_likelihood_in(int node, const void *row, const float *sum_out, const bool *used);
+	void _affinity(const void *data, int node, float *row, float *buf) const;
+	void _tiled_dots(const void *row, const void *rows, graph_t::neighbor_container nbrs, float *prods);
+	void _tiled_gradient(float *d, const void *rows, graph_t::neighbor_container nbrs, const float *prods);
+
+	// Rows of a matrix are _row_bytes apart from its base pointer.
+	void *_row(void *data, int node) const
+	{
+		return (char *)data + (size_t)node * _row_bytes;
+	}
+
+	const void *_row(const void *data, int node) const
+	{
+		return (const char *)data + (size_t)node * _row_bytes;
+	}
+
+	void _prefetch_row(const void *data, const int *nbr, const int *end) const
+	{
+		if (_prefetch_distance > 0 && end - nbr > _prefetch_distance) affi_prefetch(_row(data, nbr[_prefetch_distance]), _row_bytes);
+	}
 };
 
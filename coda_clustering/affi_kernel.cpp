@@ -0,0 +1,652 @@
+#include "affi_kernel.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define AFFI_X86
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <malloc.h>
+#define AFFI_TARGET_AVX2
+#define AFFI_TARGET_AVX512
+#else
+#ifdef AFFI_X86
+#include <cpuid.h>
+#endif
+#define AFFI_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define AFFI_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma,f16c")))
+#endif
+
+static float _bf16_to_float(unsigned short h)
+{
+	unsigned int u = (unsigned int)h << 16;
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+static unsigned short _float_to_bf16(float f)
+{
+	unsigned int u;
+	memcpy(&u, &f, sizeof(u));
+	u += 0x7fff + ((u >> 16) & 1);
+	return (unsigned short)(u >> 16);
+}
+
+static float _fp16_to_float(unsigned short h)
+{
+	unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+	unsigned int exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+	unsigned int u;
+	if (exp == 0)
+	{
+		float f = (float)mant * 5.9604645e-8f;
+		memcpy(&u, &f, sizeof(u));
+		u |= sign;
+	}
+	else if (exp == 31)
+	{
+		u = sign | 0x7f800000 | (mant << 13);
+	}
+	else
+	{
+		u = sign | ((exp + 112) << 23) | (mant << 13);
+	}
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+static unsigned short _float_to_fp16(float f)
+{
+	unsigned int u;
+	memcpy(&u, &f, sizeof(u));
+	unsigned short sign = (unsigned short)((u >> 16) & 0x8000);
+	unsigned int abs = u & 0x7fffffff;
+	if (abs > 0x7f800000) return sign | 0x7e00;
+	if (abs >= 0x47800000) return sign | 0x7c00;
+	if (abs < 0x38800000)
+	{
+		float a;
+		memcpy(&a, &abs, sizeof(a));
+		return sign | (unsigned short)std::nearbyint(a * 16777216.0f);
+	}
+	unsigned int h = (abs - 0x38000000) >> 13, rem = abs & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;
+	return sign | (unsigned short)h;
+}
+
+// Scalar storage traits: get/set convert one entry, round returns the value
+// that set would store.
+struct _scalar_fp32
+{
+	static float get(const void *p, int c) { return ((const float *)p)[c]; }
+	static void set(void *p, int c, float v) { ((float *)p)[c] = v; }
+	static float round(float v) { return v; }
+};
+
+struct _scalar_bf16
+{
+	static float get(const void *p, int c) { return _bf16_to_float(((const unsigned short *)p)[c]); }
+	static void set(void *p, int c, float v) { ((unsigned short *)p)[c] = _float_to_bf16(v); }
+	static float round(float v) { return _bf16_to_float(_float_to_bf16(v)); }
+};
+
+struct _scalar_fp16
+{
+	static float get(const void *p, int c) { return _fp16_to_float(((const unsigned short *)p)[c]); }
+	static void set(void *p, int c, float v) { ((unsigned short *)p)[c] = _float_to_fp16(v); }
+	static float round(float v) { return _fp16_to_float(_float_to_fp16(v)); }
+};
+
+template <class A, class B, int K> static float _dot_scalar(const void *a, const void *b, int k)
+{
+	if (K > 0) k = K;
+	float sum = 0.0f;
+	for (int c = 0; c < k; ++c) sum += A::get(a, c) * B::get(b, c);
+	return sum;
+}
+
+template <class S, int K> static float _dot_vec_scalar(const void *a, const float *b, int k)
+{
+	return _dot_scalar<S, _scalar_fp32, K>(a, b, k);
+}
+
+template <int K> static float _norm_scalar(const float *a, int k)
+{
+	return _dot_scalar<_scalar_fp32, _scalar_fp32, K>(a, a, k);
+}
+
+template <class S, int K> static void _axpy_scalar(float *y, float a, const void *x, int k)
+{
+	if (K > 0) k = K;
+	for (int c = 0; c < k; ++c) y[c] += a * S::get(x, c);
+}
+
+template <class S, int K> static void _sub_scalar(float *y, const void *a, const float *b, int k)
+{
+	if (K > 0) k = K;
+	for (int c = 0; c < k; ++c) y[c] = S::get(a, c) - b[c];
+}
+
+template <class S, int K> static void _step_scalar(void *y, const void *x, float alpha, const float *d, int k)
+{
+	if (K > 0) k = K;
+	for (int c = 0; c < k; ++c) S::set(y, c, std::max(0.0f, S::get(x, c) + alpha * d[c]));
+}
+
+template <class S, int K> static void _step_sum_scalar(void *y, const void *x, float alpha, const float *d, float *sum, int k)
+{
+	if (K > 0) k = K;
+	for (int c = 0; c < k; ++c)
+	{
+		S::set(y, c, std::max(0.0f, S::get(x, c) + alpha * d[c]));
+		sum[c] += S::get(y, c);
+	}
+}
+
+template <class S, int K> static float _dot_step_scalar(const void *a, const void *x, float alpha, const float *d, int k)
+{
+	if (K > 0) k = K;
+	float sum = 0.0f;
+	for (int c = 0; c < k; ++c) sum += S::get(a, c) * S::round(std::max(0.0f, S::get(x, c) + alpha * d[c]));
+	return sum;
+}
+
+template <class S, int K> static void _load_scalar(float *y, const void *x, int k)
+{
+	if (K > 0) k = K;
+	for (int c = 0; c < k; ++c) y[c] = S::get(x, c);
+}
+
+template <class S, int K> static void _store_scalar(void *y, const float *x, int k)
+{
+	if (K > 0) k = K;
+	for (int c = 0; c < k; ++c) S::set(y, c, x[c]);
+}
+
+template <class S> static void _set_scalar(void *y, int c, float value)
+{
+	S::set(y, c, value);
+}
+
+template <class S, int K> static affi_kernel _scalar_kernel(affi_storage storage)
+{
+	affi_kernel kernel = { "scalar", storage, K, _dot_scalar<S, S, K>, _dot_vec_scalar<S, K>, _norm_scalar<K>, _axpy_scalar<S, K>, _sub_scalar<S, K>,
+		_step_scalar<S, K>, _step_sum_scalar<S, K>, _dot_step_scalar<S, K>, _load_scalar<S, K>, _store_scalar<S, K>, _set_scalar<S> };
+	return kernel;
+}
+
+#ifdef AFFI_X86
+
+// Vector storage traits: load/store convert eight (avx2) or sixteen (avx512)
+// entries starting at index c, round returns the value store would write.
+struct _avx2_fp32
+{
+	AFFI_TARGET_AVX2 static inline __m256 load(const void *p, int c) { return _mm256_load_ps((const float *)p + c); }
+	AFFI_TARGET_AVX2 static inline void store(void *p, int c, __m256 v) { _mm256_store_ps((float *)p + c, v); }
+	AFFI_TARGET_AVX2 static inline __m256 round(__m256 v) { return v; }
+};
+
+struct _avx2_bf16
+{
+	AFFI_TARGET_AVX2 static inline __m256 load(const void *p, int c)
+	{
+		__m128i h = _mm_load_si128((const __m128i *)((const unsigned short *)p + c));
+		return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+	}
+	AFFI_TARGET_AVX2 static inline __m256i bits(__m256 v)
+	{
+		__m256i u = _mm256_castps_si256(v);
+		__m256i odd = _mm256_and_si256(_mm256_srli_epi32(u, 16), _mm256_set1_epi32(1));
+		return _mm256_srli_epi32(_mm256_add_epi32(u, _mm256_add_epi32(odd, _mm256_set1_epi32(0x7fff))), 16);
+	}
+	AFFI_TARGET_AVX2 static inline void store(void *p, int c, __m256 v)
+	{
+		__m256i u = bits(v);
+		__m128i h = _mm_packus_epi32(_mm256_castsi256_si128(u), _mm256_extracti128_si256(u, 1));
+		_mm_store_si128((__m128i *)((unsigned short *)p + c), h);
+	}
+	AFFI_TARGET_AVX2 static inline __m256 round(__m256 v) { return _mm256_castsi256_ps(_mm256_slli_epi32(bits(v), 16)); }
+};
+
+struct _avx2_fp16
+{
+	AFFI_TARGET_AVX2 static inline __m256 load(const void *p, int c)
+	{
+		return _mm256_cvtph_ps(_mm_load_si128((const __m128i *)((const unsigned short *)p + c)));
+	}
+	AFFI_TARGET_AVX2 static inline void store(void *p, int c, __m256 v)
+	{
+		_mm_store_si128((__m128i *)((unsigned short *)p + c), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+	}
+	AFFI_TARGET_AVX2 static inline __m256 round(__m256 v) { return _mm256_cvtph_ps(_mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT)); }
+};
+
+AFFI_TARGET_AVX2 static inline float _hsum_avx2(__m256 v)
+{
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+template <class A, class B, int K> AFFI_TARGET_AVX2 static float _dot_avx2(const void *a, const void *b, int k)
+{
+	if (K > 0) k = K;
+	__m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+	for (int c = 0; c < k; c += 16)
+	{
+		sum0 = _mm256_fmadd_ps(A::load(a, c), B::load(b, c), sum0);
+		sum1 = _mm256_fmadd_ps(A::load(a, c + 8), B::load(b, c + 8), sum1);
+	}
+	return _hsum_avx2(_mm256_add_ps(sum0, sum1));
+}
+
+template <class S, int K> AFFI_TARGET_AVX2 static float _dot_vec_avx2(const void *a, const float *b, int k)
+{
+	return _dot_avx2<S, _avx2_fp32, K>(a, b, k);
+}
+
+template <int K> AFFI_TARGET_AVX2 static float _norm_avx2(const float *a, int k)
+{
+	return _dot_avx2<_avx2_fp32, _avx2_fp32, K>(a, a, k);
+}
+
+template <class S, int K> AFFI_TARGET_AVX2 static void _axpy_avx2(float *y, float a, const void *x, int k)
+{
+	if (K > 0) k = K;
+	__m256 va = _mm256_set1_ps(a);
+	for (int c = 0; c < k; c += 8)
+	{
+		_mm256_store_ps(y + c, _mm256_fmadd_ps(va, S::load(x, c), _mm256_load_ps(y + c)));
+	}
+}
+
+template <class S, int K> AFFI_TARGET_AVX2 static void _sub_avx2(float *y, const void *a, const float *b, int k)
+{
+	if (K > 0) k = K;
+	for (int c = 0; c < k; c += 8)
+	{
+		_mm256_store_ps(y + c, _mm256_sub_ps(S::load(a, c), _mm256_load_ps(b + c)));
+	}
+}
+
+template <class S, int K> AFFI_TARGET_AVX2 static void _step_avx2(void *y, const void *x, float alpha, const float *d, int k)
+{
+	if (K > 0) k = K;
+	__m256 va = _mm256_set1_ps(alpha), zero = _mm256_setzero_ps();
+	for (int c = 0; c < k; c += 8)
+	{
+		S::store(y, c, _mm256_max_ps(zero, _mm256_fmadd_ps(va, _mm256_load_ps(d + c), S::load(x, c))));
+	}
+}
+
+template <class S, int K> AFFI_TARGET_AVX2 static void _step_sum_avx2(void *y, const void *x, float alpha, const float *d, float *sum, int k)
+{
+	if (K > 0) k = K;
+	__m256 va = _mm256_set1_ps(alpha), zero = _mm256_setzero_ps();
+	for (int c = 0; c < k; c += 8)
+	{
+		__m256 v = S::round(_mm256_max_ps(zero, _mm256_fmadd_ps(va, _mm256_load_ps(d + c), S::load(x, c))));
+		S::store(y, c, v);
+		_mm256_store_ps(sum + c, _mm256_add_ps(v, _mm256_load_ps(sum + c)));
+	}
+}
+
+template <class S, int K> AFFI_TARGET_AVX2 static float _dot_step_avx2(const void *a, const void *x, float alpha, const float *d, int k)
+{
+	if (K > 0) k = K;
+	__m256 va = _mm256_set1_ps(alpha), zero = _mm256_setzero_ps();
+	__m256 sum = _mm256_setzero_ps();
+	for (int c = 0; c < k; c += 8)
+	{
+		__m256 v = S::round(_mm256_max_ps(zero, _mm256_fmadd_ps(va, _mm256_load_ps(d + c), S::load(x, c))));
+		sum = _mm256_fmadd_ps(S::load(a, c), v, sum);
+	}
+	return _hsum_avx2(sum);
+}
+
+template <class S, int K> AFFI_TARGET_AVX2 static void _load_avx2(float *y, const void *x, int k)
+{
+	if (K > 0) k = K;
+	for (int c = 0; c < k; c += 8) _mm256_store_ps(y + c, S::load(x, c));
+}
+
+template <class S, int K> AFFI_TARGET_AVX2 static void _store_avx2(void *y, const float *x, int k)
+{
+	if (K > 0) k = K;
+	for (int c = 0; c < k; c += 8) S::store(y, c, _mm256_load_ps(x + c));
+}
+
+template <class S, class T, int K> static affi_kernel _avx2_kernel(affi_storage storage)
+{
+	affi_kernel kernel = { "avx2", storage, K, _dot_avx2<S, S, K>, _dot_vec_avx2<S, K>, _norm_avx2<K>, _axpy_avx2<S, K>, _sub_avx2<S, K>,
+		_step_avx2<S, K>, _step_sum_avx2<S, K>, _dot_step_avx2<S, K>, _load_avx2<S, K>, _store_avx2<S, K>, _set_scalar<T> };
+	return kernel;
+}
+
+struct _avx512_fp32
+{
+	AFFI_TARGET_AVX512 static inline __m512 load(const void *p, int c) { return _mm512_load_ps((const float *)p + c); }
+	AFFI_TARGET_AVX512 static inline void store(void *p, int c, __m512 v) { _mm512_store_ps((float *)p + c, v); }
+	AFFI_TARGET_AVX512 static inline __m512 round(__m512 v) { return v; }
+};
+
+struct _avx512_bf16
+{
+	AFFI_TARGET_AVX512 static inline __m512 load(const void *p, int c)
+	{
+		__m256i h = _mm256_load_si256((const __m256i *)((const unsigned short *)p + c));
+		return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16));
+	}
+	AFFI_TARGET_AVX512 static inline __m512i bits(__m512 v)
+	{
+		__m512i u = _mm512_castps_si512(v);
+		__m512i odd = _mm512_and_si512(_mm512_srli_epi32(u, 16), _mm512_set1_epi32(1));
+		return _mm512_srli_epi32(_mm512_add_epi32(u, _mm512_add_epi32(odd, _mm512_set1_epi32(0x7fff))), 16);
+	}
+	AFFI_TARGET_AVX512 static inline void store(void *p, int c, __m512 v)
+	{
+		_mm256_store_si256((__m256i *)((unsigned short *)p + c), _mm512_cvtepi32_epi16(bits(v)));
+	}
+	AFFI_TARGET_AVX512 static inline __m512 round(__m512 v) { return _mm512_castsi512_ps(_mm512_slli_epi32(bits(v), 16)); }
+};
+
+struct _avx512_fp16
+{
+	AFFI_TARGET_AVX512 static inline __m512 load(const void *p, int c)
+	{
+		return _mm512_cvtph_ps(_mm256_load_si256((const __m256i *)((const unsigned short *)p + c)));
+	}
+	AFFI_TARGET_AVX512 static inline void store(void *p, int c, __m512 v)
+	{
+		_mm256_store_si256((__m256i *)((unsigned short *)p + c), _mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+	}
+	AFFI_TARGET_AVX512 static inline __m512 round(__m512 v) { return _mm512_cvtph_ps(_mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT)); }
+};
+
+AFFI_TARGET_AVX512 static inline float _hsum_avx512(__m512 v)
+{
+	__m256 lo = _mm512_castps512_ps256(v);
+	__m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+	return _hsum_avx2(_mm256_add_ps(lo, hi));
+}
+
+template <class A, class B, int K> AFFI_TARGET_AVX512 static float _dot_avx512(const void *a, const void *b, int k)
+{
+	if (K > 0) k = K;
+	__m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+	int c = 0;
+	for (; c + 32 <= k; c += 32)
+	{
+		sum0 = _mm512_fmadd_ps(A::load(a, c), B::load(b, c), sum0);
+		sum1 = _mm512_fmadd_ps(A::load(a, c + 16), B::load(b, c + 16), sum1);
+	}
+	if (c < k) sum0 = _mm512_fmadd_ps(A::load(a, c), B::load(b, c), sum0);
+	return _hsum_avx512(_mm512_add_ps(sum0, sum1));
+}
+
+template <class S, int K> AFFI_TARGET_AVX512 static float _dot_vec_avx512(const void *a, const float *b, int k)
+{
+	return _dot_avx512<S, _avx512_fp32, K>(a, b, k);
+}
+
+template <int K> AFFI_TARGET_AVX512 static float _norm_avx512(const float *a, int k)
+{
+	return _dot_avx512<_avx512_fp32, _avx512_fp32, K>(a, a, k);
+}
+
+template <class S, int K> AFFI_TARGET_AVX512 static void _axpy_avx512(float *y, float a, const void *x, int k)
+{
+	if (K > 0) k = K;
+	__m512 va = _mm512_set1_ps(a);
+	for (int c = 0; c < k; c += 16)
+	{
+		_mm512_store_ps(y + c, _mm512_fmadd_ps(va, S::load(x, c), _mm512_load_ps(y + c)));
+	}
+}
+
+template <class S, int K> AFFI_TARGET_AVX512 static void _sub_avx512(float *y, const void *a, const float *b, int k)
+{
+	if (K > 0) k = K;
+	for (int c = 0; c < k; c += 16)
+	{
+		_mm512_store_ps(y + c, _mm512_sub_ps(S::load(a, c), _mm512_load_ps(b + c)));
+	}
+}
+
+template <class S, int K> AFFI_TARGET_AVX512 static void _step_avx512(void *y, const void *x, float alpha, const float *d, int k)
+{
+	if (K > 0) k = K;
+	__m512 va = _mm512_set1_ps(alpha), zero = _mm512_setzero_ps();
+	for (int c = 0; c < k; c += 16)
+	{
+		S::store(y, c, _mm512_max_ps(zero, _mm512_fmadd_ps(va, _mm512_load_ps(d + c), S::load(x, c))));
+	}
+}
+
+template <class S, int K> AFFI_TARGET_AVX512 static void _step_sum_avx512(void *y, const void *x, float alpha, const float *d, float *sum, int k)
+{
+	if (K > 0) k = K;
+	__m512 va = _mm512_set1_ps(alpha), zero = _mm512_setzero_ps();
+	for (int c = 0; c < k; c += 16)
+	{
+		__m512 v = S::round(_mm512_max_ps(zero, _mm512_fmadd_ps(va, _mm512_load_ps(d + c), S::load(x, c))));
+		S::store(y, c, v);
+		_mm512_store_ps(sum + c, _mm512_add_ps(v, _mm512_load_ps(sum + c)));
+	}
+}
+
+template <class S, int K> AFFI_TARGET_AVX512 static float _dot_step_avx512(const void *a, const void *x, float alpha, const float *d, int k)
+{
+	if (K > 0) k = K;
+	__m512 va = _mm512_set1_ps(alpha), zero = _mm512_setzero_ps();
+	__m512 sum = _mm512_setzero_ps();
+	for (int c = 0; c < k; c += 16)
+	{
+		__m512 v = S::round(_mm512_max_ps(zero, _mm512_fmadd_ps(va, _mm512_load_ps(d + c), S::load(x, c))));
+		sum = _mm512_fmadd_ps(S::load(a, c), v, sum);
+	}
+	return _hsum_avx512(sum);
+}
+
+template <class S, int K> AFFI_TARGET_AVX512 static void _load_avx512(float *y, const void *x, int k)
+{
+	if (K > 0) k = K;
+	for (int c = 0; c < k; c += 16) _mm512_store_ps(y + c, S::load(x, c));
+}
+
+template <class S, int K> AFFI_TARGET_AVX512 static void _store_avx512(void *y, const float *x, int k)
+{
+	if (K > 0) k = K;
+	for (int c = 0; c < k; c += 16) S::store(y, c, _mm512_load_ps(x + c));
+}
+
+template <class S, class T, int K> static affi_kernel _avx512_kernel(affi_storage storage)
+{
+	affi_kernel kernel = { "avx512", storage, K, _dot_avx512<S, S, K>, _dot_vec_avx512<S, K>, _norm_avx512<K>, _axpy_avx512<S, K>, _sub_avx512<S, K>,
+		_step_avx512<S, K>, _step_sum_avx512<S, K>, _dot_step_avx512<S, K>, _load_avx512<S, K>, _store_avx512<S, K>, _set_scalar<T> };
+	return kernel;
+}
+
+static void _cpuid(int info[4], int leaf, int subleaf)
+{
+#ifdef _MSC_VER
+	__cpuidex(info, leaf, subleaf);
+#else
+	unsigned int a, b, c, d;
+	__cpuid_count(leaf, subleaf, a, b, c, d);
+	info[0] = (int)a;
+	info[1] = (int)b;
+	info[2] = (int)c;
+	info[3] = (int)d;
+#endif
+}
+
+static unsigned long long _xgetbv0()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int lo, hi;
+	__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+#endif
+
+// K is the row size the kernels are compiled for, 0 for any.
+template <int K> static affi_kernel _make_kernel(affi_storage storage)
+{
+	affi_kernel kernel;
+	switch (storage)
+	{
+	case affi_storage::bf16:
+		kernel = _scalar_kernel<_scalar_bf16, K>(storage);
+		break;
+	case affi_storage::fp16:
+		kernel = _scalar_kernel<_scalar_fp16, K>(storage);
+		break;
+	default:
+		kernel = _scalar_kernel<_scalar_fp32, K>(storage);
+		break;
+	}
+
+#ifdef AFFI_X86
+	int info[4];
+	_cpuid(info, 0, 0);
+	int max_leaf = info[0];
+	_cpuid(info, 1, 0);
+	bool has_osxsave = (info[2] & (1 << 27)) != 0;
+	bool has_fma = (info[2] & (1 << 12)) != 0;
+	bool has_f16c = (info[2] & (1 << 29)) != 0;
+	if (!has_osxsave || max_leaf < 7) return kernel;
+
+	unsigned long long xcr0 = _xgetbv0();
+	_cpuid(info, 7, 0);
+	bool has_avx2 = has_fma && has_f16c && (info[1] & (1 << 5)) != 0 && (xcr0 & 0x06) == 0x06;
+	bool has_avx512 = has_avx2 && (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;
+
+	if (has_avx512)
+	{
+		switch (storage)
+		{
+		case affi_storage::bf16:
+			return _avx512_kernel<_avx512_bf16, _scalar_bf16, K>(storage);
+		case affi_storage::fp16:
+			return _avx512_kernel<_avx512_fp16, _scalar_fp16, K>(storage);
+		default:
+			return _avx512_kernel<_avx512_fp32, _scalar_fp32, K>(storage);
+		}
+	}
+	if (has_avx2)
+	{
+		switch (storage)
+		{
+		case affi_storage::bf16:
+			return _avx2_kernel<_avx2_bf16, _scalar_bf16, K>(storage);
+		case affi_storage::fp16:
+			return _avx2_kernel<_avx2_fp16, _scalar_fp16, K>(storage);
+		default:
+			return _avx2_kernel<_avx2_fp32, _scalar_fp32, K>(storage);
+		}
+	}
+#endif
+
+	return kernel;
+}
+
+int affi_padded_size(int k)
+{
+	return (k + affi_row_align - 1) / affi_row_align * affi_row_align;
+}
+
+size_t affi_storage_size(affi_storage storage)
+{
+	return storage == affi_storage::fp32 ? sizeof(float) : sizeof(unsigned short);
+}
+
+static const int _fixed_row_sizes[] = { 16, 32, 64, 128, 256 };
+const int _fixed_row_size_num = sizeof(_fixed_row_sizes) / sizeof(_fixed_row_sizes[0]);
+
+static affi_kernel _make_kernel(affi_storage storage, int row_size)
+{
+	switch (row_size)
+	{
+	case 16:
+		return _make_kernel<16>(storage);
+	case 32:
+		return _make_kernel<32>(storage);
+	case 64:
+		return _make_kernel<64>(storage);
+	case 128:
+		return _make_kernel<128>(storage);
+	case 256:
+		return _make_kernel<256>(storage);
+	default:
+		return _make_kernel<0>(storage);
+	}
+}
+
+// One table per storage type; entry 0 takes any row size, entry i + 1 is
+// compiled for _fixed_row_sizes[i].
+struct _kernel_table
+{
+	affi_kernel kernels[3][_fixed_row_size_num + 1];
+
+	_kernel_table()
+	{
+		const affi_storage storages[] = { affi_storage::fp32, affi_storage::bf16, affi_storage::fp16 };
+		for (int s = 0; s < 3; ++s)
+		{
+			kernels[s][0] = _make_kernel(storages[s], 0);
+			for (int i = 0; i < _fixed_row_size_num; ++i) kernels[s][i + 1] = _make_kernel(storages[s], _fixed_row_sizes[i]);
+		}
+	}
+};
+
+const affi_kernel &affi_select_kernel(affi_storage storage, int row_size)
+{
+	static const _kernel_table table;
+	int s = storage == affi_storage::bf16 ? 1 : storage == affi_storage::fp16 ? 2 : 0;
+	for (int i = 0; i < _fixed_row_size_num; ++i)
+	{
+		if (_fixed_row_sizes[i] == row_size) return table.kernels[s][i + 1];
+	}
+	return table.kernels[s][0];
+}
+
+void *affi_alloc_bytes(size_t size)
+{
+	void *ptr;
+#ifdef _MSC_VER
+	ptr = _aligned_malloc(std::max((size_t)1, size), 64);
+#else
+	if (posix_memalign(&ptr, 64, std::max((size_t)1, size)) != 0) ptr = NULL;
+#endif
+	if (ptr == NULL) throw std::bad_alloc();
+	return ptr;
+}
+
+float *affi_alloc(size_t size)
+{
+	return (float *)affi_alloc_bytes(size * sizeof(float));
+}
+
+void affi_free(void *ptr)
+{
+#ifdef _MSC_VER
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <xmmintrin.h>
+#define AFFI_PREFETCH(p) _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#elif defined(__GNUC__)
+#define AFFI_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define AFFI_PREFETCH(p) ((void)(p))
+#endif
+
+// Rows of the affinity matrices are padded to a multiple of affi_row_align
+// entries and start on a 64-byte boundary, so the vector kernels below never
+// need a scalar tail. Padding entries must be kept at zero.
+const int affi_row_align = 16;
+
+// Element type of the affinity rows. Gradients, cluster sums and every
+// accumulation stay fp32; the 16-bit formats only shrink the rows and the
+// bytes gathered per edge. fp16 keeps more mantissa than bf16 but saturates
+// above 65504.
+enum class affi_storage
+{
+	fp32, bf16, fp16
+};
+
+// Arguments documented as rows point to affinity rows in the storage type
+// of the kernel table; all other vectors are fp32.
+struct affi_kernel
+{
+	const char *name;
+	affi_storage storage;
+
+	// row size the loops below are unrolled for, 0 if k is taken at run time
+	int row_size;
+
+	// sum(a[c] * b[c]), a and b rows
+	float (*dot)(const void *a, const void *b, int k);
+
+	// sum(a[c] * b[c]), a row
+	float (*dot_vec)(const void *a, const float *b, int k);
+
+	// sum(a[c] * a[c])
+	float (*norm)(const float *a, int k);
+
+	// y[c] += a * x[c], x row
+	void (*axpy)(float *y, float a, const void *x, int k);
+
+	// y[c] = a[c] - b[c], a row
+	void (*sub)(float *y, const void *a, const float *b, int k);
+
+	// y[c] = max(0, x[c] + alpha * d[c]), x and y rows
+	void (*step)(void *y, const void *x, float alpha, const float *d, int k);
+
+	// step, then sum[c] += y[c] as stored
+	void (*step_sum)(void *y, const void *x, float alpha, const float *d, float *sum, int k);
+
+	// sum(a[c] * y[c]) for the y that step would store, a and x rows
+	float (*dot_step)(const void *a, const void *x, float alpha, const float *d, int k);
+
+	// y[c] = x[c], x row
+	void (*load)(float *y, const void *x, int k);
+
+	// y[c] = x[c], y row
+	void (*store)(void *y, const float *x, int k);
+
+	// y[c] = value, y row
+	void (*set)(void *y, int c, float value);
+};
+
+int affi_padded_size(int k);
+size_t affi_storage_size(affi_storage storage);
+
+// Returns the kernels compiled for row_size when there are any (padded sizes
+// 16, 32, 64, 128 and 256), the generic ones otherwise. Fixed-size kernels
+// ignore their k argument.
+const affi_kernel &affi_select_kernel(affi_storage storage = affi_storage::fp32, int row_size = 0);
+
+// Requests the cache lines of bytes starting at p, at most the first
+// affi_prefetch_lines of them; longer rows are left to the hardware
+// prefetcher once their head has been touched.
+const int affi_prefetch_lines = 16;
+
+inline void affi_prefetch(const void *p, size_t bytes)
+{
+	const char *line = (const char *)p;
+	size_t line_num = (bytes + 63) / 64;
+	if (line_num > affi_prefetch_lines) line_num = affi_prefetch_lines;
+	for (size_t i = 0; i < line_num; ++i) AFFI_PREFETCH(line + i * 64);
+}
+
+void *affi_alloc_bytes(size_t size);
+float *affi_alloc(size_t size);
+void affi_free(void *ptr);
@@ -0,0 +1,122 @@
+#include "affi_optimizer.h"
+#include "affi_kernel.h"
+
+#include <cmath>
+#include <algorithm>
+
+affi_momentum::affi_momentum(float beta)
+{
+	_beta = beta;
+	_node_num = 0;
+	_row_size = 0;
+	_velocity[0] = _velocity[1] = nullptr;
+}
+
+affi_momentum::~affi_momentum()
+{
+	affi_free(_velocity[0]);
+	affi_free(_velocity[1]);
+}
+
+void affi_momentum::init(int node_num, int row_size)
+{
+	affi_free(_velocity[0]);
+	affi_free(_velocity[1]);
+	_node_num = node_num;
+	_row_size = row_size;
+	_velocity[0] = affi_alloc((size_t)node_num * row_size);
+	_velocity[1] = affi_alloc((size_t)node_num * row_size);
+}
+
+void affi_momentum::reset(bool)
+{
+}
+
+void affi_momentum::clear(bool is_out, int node)
+{
+	float *v = _velocity[is_out ? 0 : 1] + (size_t)node * _row_size;
+	std::fill(v, v + _row_size, 0.0f);
+}
+
+void affi_momentum::begin(bool)
+{
+}
+
+void affi_momentum::direction(bool is_out, int node, float *d)
+{
+	float *v = _velocity[is_out ? 0 : 1] + (size_t)node * _row_size;
+	for (int c = 0; c < _row_size; ++c)
+	{
+		v[c] = _beta * v[c] + d[c];
+		d[c] = v[c];
+	}
+}
+
+affi_adam::affi_adam(float beta1, float beta2, float eps)
+{
+	_beta1 = beta1;
+	_beta2 = beta2;
+	_eps = eps;
+	_node_num = 0;
+	_row_size = 0;
+	_moment1[0] = _moment1[1] = nullptr;
+	_moment2[0] = _moment2[1] = nullptr;
+	_step[0] = _step[1] = 0;
+}
+
+affi_adam::~affi_adam()
+{
+	for (int s = 0; s < 2; ++s)
+	{
+		affi_free(_moment1[s]);
+		affi_free(_moment2[s]);
+	}
+}
+
+void affi_adam::init(int node_num, int row_size)
+{
+	_node_num = node_num;
+	_row_size = row_size;
+	for (int s = 0; s < 2; ++s)
+	{
+		affi_free(_moment1[s]);
+		affi_free(_moment2[s]);
+		_moment1[s] = affi_alloc((size_t)node_num * row_size);
+		_moment2[s] = affi_alloc((size_t)node_num * row_size);
+	}
+}
+
+void affi_adam::reset(bool is_out)
+{
+	_step[is_out ? 0 : 1] = 0;
+}
+
+void affi_adam::clear(bool is_out, int node)
+{
+	int s = is_out ? 0 : 1;
+	size_t offset = (size_t)node * _row_size;
+	std::fill(_moment1[s] + offset, _moment1[s] + offset + _row_size, 0.0f);
+	std::fill(_moment2[s] + offset, _moment2[s] + offset + _row_size, 0.0f);
+}
+
+void affi_adam::begin(bool is_out)
+{
+	int s = is_out ? 0 : 1;
+	++_step[s];
+	_scale1[s] = 1.0f / (1.0f - (float)pow(_beta1, _step[s]));
+	_scale2[s] = 1.0f / (1.0f - (float)pow(_beta2, _step[s]));
+}
+
+void affi_adam::direction(bool is_out, int node, float *d)
+{
+	int s = is_out ? 0 : 1;
+	float *m1 = _moment1[s] + (size_t)node * _row_size;
+	float *m2 = _moment2[s] + (size_t)node * _row_size;
+	float scale1 = _scale1[s], scale2 = _scale2[s];
+	for (int c = 0; c < _row_size; ++c)
+	{
+		m1[c] = _beta1 * m1[c] + (1.0f - _beta1) * d[c];
+		m2[c] = _beta2 * m2[c] + (1.0f - _beta2) * d[c] * d[c];
+		d[c] = m1[c] * scale1 / (sqrt(m2[c] * scale2) + _eps);
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+// Turns the gradient rows computed by affi_directed_model into search
+// directions before its backtracking line search. The model calls begin()
+// once per step and side on the calling thread, then direction() for every
+// node from the workers. After init() and whenever a step fails or the
+// direction stops being an ascent direction it calls reset() on the calling
+// thread and clear() for every node from the workers, so each row of state
+// is first touched by the thread that updates it.
+class affi_optimizer
+{
+public:
+	virtual ~affi_optimizer() { }
+
+	virtual void init(int node_num, int row_size) = 0;
+	virtual void reset(bool is_out) = 0;
+	virtual void clear(bool is_out, int node) = 0;
+	virtual void begin(bool is_out) = 0;
+	virtual void direction(bool is_out, int node, float *d) = 0;
+};
+
+// Heavy-ball momentum: v = beta * v + g, direction v.
+class affi_momentum : public affi_optimizer
+{
+public:
+	affi_momentum(float beta = 0.9);
+	~affi_momentum();
+
+	void init(int node_num, int row_size);
+	void reset(bool is_out);
+	void clear(bool is_out, int node);
+	void begin(bool is_out);
+	void direction(bool is_out, int node, float *d);
+
+private:
+	float _beta;
+	int _node_num, _row_size;
+	float *_velocity[2];
+};
+
+// Adam: bias-corrected first and second moments per coordinate, direction
+// m / (sqrt(s) + eps).
+class affi_adam : public affi_optimizer
+{
+public:
+	affi_adam(float beta1 = 0.9, float beta2 = 0.999, float eps = 1e-8);
+	~affi_adam();
+
+	void init(int node_num, int row_size);
+	void reset(bool is_out);
+	void clear(bool is_out, int node);
+	void begin(bool is_out);
+	void direction(bool is_out, int node, float *d);
+
+private:
+	float _beta1, _beta2, _eps;
+	int _node_num, _row_size;
+	float *_moment1[2], *_moment2[2];
+	int _step[2];
+	float _scale1[2], _scale2[2];
+};
@@ -0,0 +1,142 @@
+#include "affi_seed.h"
+
+#include <cstdio>
+
+affi_seed::affi_seed(graph_t &g, size_t thread_num) : parallel_algo(g, thread_num)
+{
+	_conductance = nullptr;
+}
+
+affi_seed::~affi_seed()
+{
+	delete[] _conductance;
+}
+
+void affi_seed::update_node(int node)
+{
+	long long cut = 0, degree_sum = _graph.out_degree(node) + _graph.in_degree(node);
+	auto out_nbrs = _graph.out_neighbors(node);
+	auto in_nbrs = _graph.in_neighbors(node);
+	for (int i = 0; i < _graph.out_degree(node); ++i) degree_sum += _graph.out_degree(out_nbrs[i]) + _graph.in_degree(out_nbrs[i]);
+	for (int i = _graph.bi_degree(node); i < _graph.in_degree(node); ++i) degree_sum += _graph.out_degree(in_nbrs[i]) + _graph.in_degree(in_nbrs[i]);
+
+	int sample_rate = std::max(1, (int)(degree_sum / 100));
+	int sample_size = 0;
+	long long step_count = 0;
+
+	for (int v : out_nbrs)
+	{
+		auto onbrs = _graph.out_neighbors(v);
+		for (int i = (int)(step_count % sample_rate); i < _graph.out_degree(v); i += sample_rate)
+		{
+			int w = onbrs[i];
+			if ((w != node) && !_graph.has_edge(node, w) && !_graph.has_edge(w, node)) ++cut;
+			++sample_size;
+		}
+		step_count += _graph.out_degree(v);
+
+		auto inbrs = _graph.in_neighbors(v);
+		for (int i = (int)(step_count % sample_rate); i < _graph.in_degree(v); i += sample_rate)
+		{
+			int w = inbrs[i];
+			if ((w != node) && !_graph.has_edge(node, w) && !_graph.has_edge(w, node)) ++cut;
+			++sample_size;
+		}
+		step_count += _graph.in_degree(v);
+	}
+
+	for (int z = _graph.bi_degree(node); z < _graph.in_degree(node); ++z)
+	{
+		int v = in_nbrs[z];
+		auto onbrs = _graph.out_neighbors(v);
+		for (int i = (int)(step_count % sample_rate); i < _graph.out_degree(v); i += sample_rate)
+		{
+			int w = onbrs[i];
+			if ((w != node) && !_graph.has_edge(node, w) && !_graph.has_edge(w, node)) ++cut;
+			++sample_size;
+		}
+		step_count += _graph.out_degree(v);
+
+		auto inbrs = _graph.in_neighbors(v);
+		for (int i = (int)(step_count % sample_rate); i < _graph.in_degree(v); i += sample_rate)
+		{
+			int w = inbrs[i];
+			if ((w != node) && !_graph.has_edge(node, w) && !_graph.has_edge(w, node)) ++cut;
+			++sample_size;
+		}
+		step_count += _graph.in_degree(v);
+	}
+
+	cut = (cut == 0 || degree_sum == 0) ? 0 : cut * degree_sum / sample_size;
+	long long size = std::min(degree_sum, _graph.edge_num());
+	_conductance[node] = (size == 0) ? 1e38f : (float)cut / (float)size;
+}
+
+int affi_seed::_select(std::pair<int, int> *pairs, int m, int *seeds, int max_num)
+{
+	printf("%d seeds\n", m);
+	std::sort(pairs, pairs + m);
+	std::reverse(pairs, pairs + m);
+	for (int c = 0; c < max_num && c < m; ++c)
+	{
+		seeds[c] = pairs[c].second;
+	}
+	return std::min(m, max_num);
+}
+
+int affi_seed::neighborhood(bool *is_seed, int *seeds, int max_num)
+{
+	int n = _graph.node_num(), m = 0;
+	auto pairs = new std::pair<int, int>[n];
+	for (int i = 0; i < n; ++i)
+	{
+		if (is_seed[i]) pairs[m++] = std::make_pair(_graph.out_degree(i) + _graph.in_degree(i) - _graph.bi_degree(i) + 1, i);
+	}
+	int num = _select(pairs, m, seeds, max_num);
+	delete[] pairs;
+	return num;
+}
+
+int affi_seed::min_neighborhood(bool *is_seed, int *seeds, int max_num)
+{
+	if (_conductance == nullptr)
+	{
+		_conductance = new float[_graph.node_num()];
+		update();
+	}
+
+	int n = _graph.node_num(), m = 0;
+	auto pairs = new std::pair<int, int>[n];
+	for (int i = 0; i < n; ++i)
+	{
+		bool is_min = true;
+		bool has_seed_neighbor = false;
+
+		auto out_nbrs = _graph.out_neighbors(i);
+		for (int j : out_nbrs)
+		{
+			if (is_seed == nullptr || is_seed[j]) has_seed_neighbor = true;
+			if (_conductance[i] >= _conductance[j])
+			{
+				is_min = false;
+				break;
+			}
+		}
+
+		auto in_nbrs = _graph.in_neighbors(i);
+		for (int j : in_nbrs)
+		{
+			if (is_seed == nullptr || is_seed[j]) has_seed_neighbor = true;
+			if (_conductance[i] >= _conductance[j])
+			{
+				is_min = false;
+				break;
+			}
+		}
+
+		if (is_min && has_seed_neighbor) pairs[m++] = std::make_pair(_graph.out_degree(i) + _graph.in_degree(i) - _graph.bi_degree(i) + 1, i);
+	}
+	int num = _select(pairs, m, seeds, max_num);
+	delete[] pairs;
+	return num;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "graph/graph.h"
+#include "graph/algorithm/base.h"
+
+#include <algorithm>
+
+class affi_seed : public graph::parallel_algo<graph::directed_graph<int, char *>>
+{
+public:
+	typedef graph::directed_graph<int, char *> graph_t;
+
+	affi_seed(graph_t &g, size_t thread_num);
+	~affi_seed();
+
+	int neighborhood(bool *is_seed, int *seeds, int max_num);
+	int min_neighborhood(bool *is_seed, int *seeds, int max_num);
+	void update_node(int node);
+
+	// Calls set(v, is_out, is_in) once for every neighbor v of the seed node.
+	template <class Func> void expand(int node, Func set)
+	{
+		auto out_nbrs = _graph.out_neighbors(node);
+		auto in_nbrs = _graph.in_neighbors(node);
+		int out_deg = _graph.out_degree(node);
+		int in_deg = _graph.in_degree(node);
+		int bi_deg = _graph.bi_degree(node);
+
+		int *nodes = new int[in_deg + out_deg - bi_deg];
+		std::copy(out_nbrs.begin(), out_nbrs.end(), nodes);
+		std::copy(in_nbrs.begin() + bi_deg, in_nbrs.end(), nodes + out_deg);
+		std::sort(nodes, nodes + in_deg + out_deg - bi_deg);
+
+		for (int i = 0; i < bi_deg; ++i)
+		{
+			set(out_nbrs[i], true, true);
+		}
+
+		for (int i = bi_deg; i < out_deg; ++i)
+		{
+			int v = out_nbrs[i];
+			bool is_out = false;
+			for (int w : _graph.out_neighbors(v))
+			{
+				if (std::binary_search(nodes, nodes + in_deg + out_deg - bi_deg, w))
+				{
+					is_out = true;
+					break;
+				}
+			}
+			set(v, is_out, true);
+		}
+
+		for (int i = bi_deg; i < in_deg; ++i)
+		{
+			int v = in_nbrs[i];
+			bool is_in = false;
+			for (int w : _graph.in_neighbors(v))
+			{
+				if (std::binary_search(nodes, nodes + in_deg + out_deg - bi_deg, w))
+				{
+					is_in = true;
+					break;
+				}
+			}
+			set(v, true, is_in);
+		}
+
+		delete[] nodes;
+	}
+
+private:
+	float *_conductance;
+
+	int _select(std::pair<int, int> *pairs, int m, int *seeds, int max_num);
+};
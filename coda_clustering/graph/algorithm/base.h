@@ -1,111 +1,400 @@
 #pragma once
 
 #include "../directed_graph.h"
+#include "../thread_affinity.h"
 
 #include <thread>
 #include <condition_variable>
 #include <mutex>
+#include <atomic>
+#include <algorithm>
 
 namespace graph
 {
+	// Node assignment of update(). round_robin gives node i to thread
+	// i % thread_num. balanced cuts the nodes into contiguous chunks of about
+	// equal edge work (1 + out degree + in degree per node) and gives each
+	// thread a contiguous range of them, heaviest chunk first, so a hub is
+	// started early instead of holding up the end of the pass; a thread that
+	// runs out steals chunks from the back of the other ranges. Updates of a
+	// subset of ids use chunks of equal node count. Only round_robin keeps
+	// per-thread partial results identical from run to run, so it is the
+	// default; callers opt in to balanced through set_partition.
+	enum class partition_type
+	{
+		round_robin, balanced
+	};
+
 	template <class Graph> class parallel_algo
 	{
 	public:
-		parallel_algo(Graph &g, size_t thread_num) : _graph(g), _thread_num(thread_num)
+		// With pin_threads worker i is bound to CPU i, see pin_threads.
+		parallel_algo(Graph &g, size_t thread_num, bool pin_threads = false) : _graph(g), _thread_num(thread_num), _update_num(0)
 		{
-			_threads = new std::thread[thread_num];
-			_cvs1 = new std::condition_variable[thread_num];
-			_cvs2 = new std::condition_variable[thread_num];
-			_signals = new _signal[thread_num];
-			_mutexes = new std::mutex[thread_num];
+			_partition = partition_type::round_robin;
+			_update_by_node = true;
+			_chunk_starts = nullptr;
+			_chunk_order = nullptr;
+			_chunk_num = 0;
+			_range_starts = new long long[thread_num + 1];
+			_ranges = aligned_new<_range>(thread_num);
+			_reduce_stride = _reduce_line;
+			_reduce_data = aligned_new<char>(thread_num * _reduce_stride);
+			_generation = 0;
+			_pending = 0;
+			_parked = 0;
+			_is_exit = false;
 
+			_threads = new std::thread[thread_num];
 			for (size_t i = 0; i < thread_num; ++i)
 			{
-				_signals[i] = _signal::suspend;
-				_threads[i] = std::thread(&parallel_algo::_update_partition, this, (Graph::node_t)i);
+				_threads[i] = std::thread(&parallel_algo::_update_partition, this, i);
 			}
-
+			if (pin_threads) this->pin_threads();
 		}
 
 		~parallel_algo()
 		{
-			for (size_t i = 0; i < _thread_num; ++i)
 			{
-				std::unique_lock<std::mutex> lock(_mutexes[i]);
-				_signals[i] = _signal::exit;
-				_cvs1[i].notify_one();
+				std::unique_lock<std::mutex> lock(_park_mutex);
+				_is_exit = true;
+				++_generation;
+				_start_cv.notify_all();
 			}
 			for (size_t i = 0; i < _thread_num; ++i)
 			{
 				_threads[i].join();
 			}
-			delete[] _mutexes;
-			delete[] _signals;
 			delete[] _threads;
-			delete[] _cvs1;
-			delete[] _cvs2;
+			aligned_delete(_ranges, _thread_num);
+			aligned_delete(_reduce_data, _thread_num * _reduce_stride);
+			delete[] _range_starts;
+			delete[] _chunk_starts;
+			delete[] _chunk_order;
 		}
 
-		virtual void update_node(typename Graph::node_t node) = 0;
+		void set_partition(partition_type partition)
+		{
+			_partition = partition;
+		}
+
+		// Binds worker i to CPU (first_cpu + i) % cpu_count(). Both partitions
+		// hand a worker the same nodes in every pass (up to stealing), so
+		// memory a pinned worker touches first stays on its socket. Returns
+		// the number of workers pinned.
+		size_t pin_threads(size_t first_cpu = 0)
+		{
+			return graph::pin_threads(_threads, _thread_num, first_cpu);
+		}
+
+		virtual void update_node(typename Graph::node_t node) { }
 		//void update_node(typename Graph::node_t node)
 		//{
 		//}
 
+		virtual void update_node(typename Graph::node_t node, size_t thread)
+		{
+			update_node(node);
+		}
+
 		void update()
 		{
-			for (size_t i = 0; i < _thread_num; ++i)
+			update(_graph.node_num());
+		}
+
+		// Runs update_node on the ids [0, node_num) only, for tasks that map
+		// the id to a subset of the graph.
+		void update(typename Graph::node_t node_num)
+		{
+			parallel_for(node_num, [this](typename Graph::node_t node, size_t thread) { update_node(node, thread); });
+		}
+
+		// Runs fn(node, thread) for the ids [0, node_num) on the workers, with
+		// the partition of update(). fn is called directly from the loop over
+		// each chunk, so it can be inlined there; only the chunk goes through
+		// a function pointer.
+		template <class Func> void parallel_for(typename Graph::node_t node_num, const Func &fn)
+		{
+			_run(node_num, &_range_loop<Func>, &fn, true);
+		}
+
+		// parallel_for over indices that are not node ids, e.g. positions in a
+		// shuffled node list: the balanced partition cuts them into chunks of
+		// equal count, as the degree of node i says nothing about index i.
+		template <class Func> void parallel_for_index(typename Graph::node_t num, const Func &fn)
+		{
+			_run(num, &_range_loop<Func>, &fn, false);
+		}
+
+		template <class Func> void parallel_for(const Func &fn)
+		{
+			parallel_for(_graph.node_num(), fn);
+		}
+
+		// Folds fn(node, thread) into one accumulator per thread with combine,
+		// starting from identity, then combines the accumulators in thread
+		// order. With round_robin the result is the same from run to run. The
+		// accumulators live a cache line apart in a buffer kept across calls.
+		template <class T, class Func, class Combine> T parallel_reduce(typename Graph::node_t node_num, T identity, const Func &fn, const Combine &combine)
+		{
+			size_t stride = (sizeof(T) + _reduce_line - 1) / _reduce_line * _reduce_line;
+			if (stride > _reduce_stride)
 			{
-				std::unique_lock<std::mutex> lock(_mutexes[i]);
-				_signals[i] = _signal::run;
-				_cvs1[i].notify_one();
+				aligned_delete(_reduce_data, _thread_num * _reduce_stride);
+				_reduce_stride = stride;
+				_reduce_data = aligned_new<char>(_thread_num * _reduce_stride);
 			}
-
-			for (size_t i = 0; i < _thread_num; ++i)
+			char *data = _reduce_data;
+			for (size_t t = 0; t < _thread_num; ++t) new (data + t * stride) T(identity);
+			parallel_for(node_num, [&](typename Graph::node_t node, size_t thread)
 			{
-				std::unique_lock<std::mutex> lock(_mutexes[i]);
-				while (_signals[i] != _signal::suspend) _cvs2[i].wait(lock);
+				T &slot = *(T *)(data + thread * stride);
+				slot = combine(slot, fn(node, thread));
+			});
+			T result = identity;
+			for (size_t t = 0; t < _thread_num; ++t)
+			{
+				T &slot = *(T *)(data + t * stride);
+				result = combine(result, slot);
+				slot.~T();
 			}
+			return result;
+		}
+
+		template <class T, class Func, class Combine> T parallel_reduce(T identity, const Func &fn, const Combine &combine)
+		{
+			return parallel_reduce(_graph.node_num(), identity, fn, combine);
 		}
 
 	protected:
+		typedef void (*_range_func)(const void *fn, typename Graph::node_t first, typename Graph::node_t last, typename Graph::node_t stride, size_t thread);
+
+		template <class Func> static void _range_loop(const void *fn, typename Graph::node_t first, typename Graph::node_t last, typename Graph::node_t stride, size_t thread)
+		{
+			const Func &f = *(const Func *)fn;
+			for (typename Graph::node_t node = first; node < last; node += stride)
+			{
+				f(node, thread);
+			}
+		}
+
+		_range_func _range_fn;
+		const void *_range_ctx;
+
+		static const size_t _reduce_line = 64;
+		char *_reduce_data;
+		size_t _reduce_stride;
+
+		void _run(typename Graph::node_t node_num, _range_func fn, const void *ctx, bool by_node)
+		{
+			_update_num = node_num;
+			_update_by_node = by_node;
+			_range_fn = fn;
+			_range_ctx = ctx;
+			if (_partition == partition_type::balanced) _make_ranges();
+			_pending = _thread_num;
+
+			{
+				std::unique_lock<std::mutex> lock(_park_mutex);
+				++_generation;
+				if (_parked > 0) _start_cv.notify_all();
+			}
+
+			for (int i = 0; i < _spin_num && _pending != 0; ++i) std::this_thread::yield();
+			if (_pending != 0)
+			{
+				std::unique_lock<std::mutex> lock(_park_mutex);
+				while (_pending != 0) _done_cv.wait(lock);
+			}
+		}
+
 		Graph &_graph;
 		size_t _thread_num;
+		typename Graph::node_t _update_num;
+		bool _update_by_node;
 		std::thread *_threads;
-		std::condition_variable *_cvs1, *_cvs2;
-		std::mutex *_mutexes;
 
-		enum _signal
+		// Workers and update() wait for each other by yielding for up to
+		// _spin_num rounds, which covers the serial gaps between the passes of
+		// an iteration, and only then park on a condition variable.
+		static const int _spin_num = 4096;
+
+		std::atomic<unsigned> _generation;
+		std::atomic<size_t> _pending;
+		size_t _parked;
+		bool _is_exit;
+		std::mutex _park_mutex;
+		std::condition_variable _start_cv, _done_cv;
+
+		partition_type _partition;
+		typename Graph::node_t *_chunk_starts, *_chunk_order;
+		typename Graph::node_t _chunk_num;
+
+		// Chunks per thread: enough for stealing to even out the last ones.
+		static const int _chunks_per_thread = 16;
+
+		// Chunk indices [first, last) left to a thread, packed as
+		// first << 32 | last so that the owner (taking first) and thieves
+		// (taking last - 1) agree through a single compare-exchange.
+		struct alignas(64) _range
 		{
-			suspend, run, exit
+			std::atomic<unsigned long long> value;
 		};
 
-		_signal *_signals;
+		long long *_range_starts;
+		_range *_ranges;
+		long long _range_chunk_size;
 
-		void _update_partition(typename Graph::node_t start)
+		class _chunk_comparer
 		{
-			while (true)
+		public:
+			_chunk_comparer(const long long *weights) : _weights(weights) { }
+
+			bool operator()(typename Graph::node_t a, typename Graph::node_t b) const
 			{
+				return _weights[a] > _weights[b];
+			}
+
+		private:
+			const long long *_weights;
+		};
+
+		// Cuts the nodes into chunks and the chunks into one contiguous range of
+		// about equal weight per thread; each range is ordered heaviest first.
+		void _make_chunks()
+		{
+			typename Graph::node_t n = _graph.node_num();
+			long long total = (long long)n + 2 * _graph.edge_num();
+			long long target = total / ((long long)_thread_num * _chunks_per_thread) + 1;
+			// Every chunk but the last reaches target, so there are at most
+			// total / target + 1 of them.
+			long long chunk_cap = (long long)_thread_num * _chunks_per_thread + 2;
+			_chunk_starts = new typename Graph::node_t[chunk_cap];
+			long long *weights = new long long[chunk_cap];
+			_chunk_num = 0;
+			long long weight = 0;
+			for (typename Graph::node_t i = 0; i < n; ++i)
+			{
+				if (weight == 0) _chunk_starts[_chunk_num] = i;
+				weight += 1 + (long long)_graph.out_degree(i) + _graph.in_degree(i);
+				if (weight >= target || i + 1 == n)
 				{
-					std::unique_lock<std::mutex> lock(_mutexes[start]);
-					while (_signals[start] == _signal::suspend) _cvs1[start].wait(lock);
-					if (_signals[start] == _signal::exit) return;
+					weights[_chunk_num++] = weight;
+					weight = 0;
 				}
+			}
+			_chunk_starts[_chunk_num] = n;
 
-				//printf("Run %d\n", start);
+			_chunk_order = new typename Graph::node_t[_chunk_num];
+			for (typename Graph::node_t c = 0; c < _chunk_num; ++c) _chunk_order[c] = c;
+			_range_starts[0] = 0;
+			long long c = 0;
+			weight = 0;
+			for (size_t t = 0; t < _thread_num; ++t)
+			{
+				long long limit = total * (long long)(t + 1) / (long long)_thread_num;
+				while (c < _chunk_num && (weight < limit || t + 1 == _thread_num)) weight += weights[c++];
+				_range_starts[t + 1] = c;
+				std::stable_sort(_chunk_order + _range_starts[t], _chunk_order + c, _chunk_comparer(weights));
+			}
+			delete[] weights;
+		}
 
-				for (Graph::node_t node = start; node < _graph.node_num(); node += (Graph::node_t)_thread_num)
+		void _make_ranges()
+		{
+			if (_update_by_node && _update_num == _graph.node_num())
+			{
+				if (_chunk_starts == nullptr) _make_chunks();
+				_range_chunk_size = 0;
+				for (size_t t = 0; t < _thread_num; ++t)
 				{
-					update_node(node);
+					_ranges[t].value = ((unsigned long long)_range_starts[t] << 32) | (unsigned long long)_range_starts[t + 1];
 				}
+				return;
+			}
 
-				//printf("Suspend %d\n", start);
+			_range_chunk_size = (long long)_update_num / ((long long)_thread_num * _chunks_per_thread) + 1;
+			unsigned long long chunk_num = ((long long)_update_num + _range_chunk_size - 1) / _range_chunk_size;
+			for (size_t t = 0; t < _thread_num; ++t)
+			{
+				unsigned long long first = chunk_num * t / _thread_num, last = chunk_num * (t + 1) / _thread_num;
+				_ranges[t].value = (first << 32) | last;
+			}
+		}
 
+		bool _take_chunk(size_t thread, bool from_back, long long &chunk)
+		{
+			unsigned long long value = _ranges[thread].value;
+			while (true)
+			{
+				unsigned long long first = value >> 32, last = value & 0xffffffffull;
+				if (first >= last) return false;
+				unsigned long long next = from_back ? (first << 32) | (last - 1) : ((first + 1) << 32) | last;
+				if (_ranges[thread].value.compare_exchange_weak(value, next))
 				{
-					std::unique_lock<std::mutex> lock(_mutexes[start]);
-					_signals[start] = _signal::suspend;
-					_cvs2[start].notify_one();
+					chunk = (long long)(from_back ? last - 1 : first);
+					return true;
 				}
+			}
+		}
+
+		void _update_chunk(long long chunk, size_t thread)
+		{
+			typename Graph::node_t first, last;
+			if (_range_chunk_size == 0)
+			{
+				first = _chunk_starts[_chunk_order[chunk]];
+				last = _chunk_starts[_chunk_order[chunk] + 1];
+			}
+			else
+			{
+				first = (typename Graph::node_t)(chunk * _range_chunk_size);
+				last = (typename Graph::node_t)std::min((chunk + 1) * _range_chunk_size, (long long)_update_num);
+			}
+			_range_fn(_range_ctx, first, last, 1, thread);
+		}
+
+		void _update_chunks(size_t thread)
+		{
+			long long chunk;
+			while (_take_chunk(thread, false, chunk)) _update_chunk(chunk, thread);
+			for (size_t i = 1; i < _thread_num; ++i)
+			{
+				size_t victim = (thread + i) % _thread_num;
+				while (_take_chunk(victim, true, chunk)) _update_chunk(chunk, thread);
+			}
+		}
 
+		void _update_partition(size_t thread)
+		{
+			unsigned generation = 0;
+			while (true)
+			{
+				for (int i = 0; i < _spin_num && _generation == generation; ++i) std::this_thread::yield();
+				if (_generation == generation)
+				{
+					std::unique_lock<std::mutex> lock(_park_mutex);
+					++_parked;
+					while (_generation == generation) _start_cv.wait(lock);
+					--_parked;
+				}
+				generation = _generation;
+				if (_is_exit) return;
+
+				if (_partition == partition_type::balanced)
+				{
+					_update_chunks(thread);
+				}
+				else
+				{
+					_range_fn(_range_ctx, (Graph::node_t)thread, _update_num, (Graph::node_t)_thread_num, thread);
+				}
+
+				if (--_pending == 0)
+				{
+					std::unique_lock<std::mutex> lock(_park_mutex);
+					_done_cv.notify_one();
+				}
 			}
 		}
 	};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+
+#include "../directed_graph.h"
+#include "base.h"
+
+namespace graph
+{
+	// Node orders are permutations given as order[new id] = old id. All of
+	// them treat the graph as undirected and put nodes whose rows are read
+	// together close to each other.
+	enum class node_order
+	{
+		degree, rcm, bfs
+	};
+
+	template <class Graph>
+	class _node_degree_comparer
+	{
+	public:
+		_node_degree_comparer(const Graph &g, bool descending) : _graph(g), _descending(descending) { }
+
+		bool operator()(typename Graph::node_t a, typename Graph::node_t b) const
+		{
+			long long da = (long long)_graph.out_degree(a) + _graph.in_degree(a);
+			long long db = (long long)_graph.out_degree(b) + _graph.in_degree(b);
+			if (da != db) return _descending ? da > db : da < db;
+			return a < b;
+		}
+
+	private:
+		const Graph &_graph;
+		bool _descending;
+	};
+
+	// Hubs first: their rows are gathered by most edges and stay cached
+	// together.
+	template <class Graph>
+	void degree_order(const Graph &g, typename Graph::node_t *order)
+	{
+		Graph::node_t n = g.node_num();
+		for (Graph::node_t i = 0; i < n; ++i) order[i] = i;
+		std::stable_sort(order, order + n, _node_degree_comparer<Graph>(g, true));
+	}
+
+	// Breadth-first numbering of each component; with by_degree the search
+	// starts from a node of least degree and visits the neighbours of a node
+	// in increasing degree (Cuthill-McKee), otherwise it starts from the
+	// largest hub and keeps adjacency order.
+	template <class Graph>
+	void _search_order(const Graph &g, typename Graph::node_t *order, bool by_degree)
+	{
+		Graph::node_t n = g.node_num();
+		Graph::node_t *starts = new Graph::node_t[n];
+		for (Graph::node_t i = 0; i < n; ++i) starts[i] = i;
+		_node_degree_comparer<Graph> comparer(g, !by_degree);
+		std::stable_sort(starts, starts + n, comparer);
+
+		bool *visited = new bool[n];
+		std::fill(visited, visited + n, false);
+		Graph::node_t tail = 0;
+		for (Graph::node_t s = 0; s < n; ++s)
+		{
+			if (visited[starts[s]]) continue;
+			Graph::node_t head = tail;
+			order[tail++] = starts[s];
+			visited[starts[s]] = true;
+			while (head < tail)
+			{
+				Graph::node_t u = order[head++];
+				Graph::node_t first = tail;
+				for (auto v : g.out_neighbors(u))
+				{
+					if (visited[v]) continue;
+					visited[v] = true;
+					order[tail++] = v;
+				}
+				for (auto v : g.in_neighbors(u))
+				{
+					if (visited[v]) continue;
+					visited[v] = true;
+					order[tail++] = v;
+				}
+				if (by_degree) std::sort(order + first, order + tail, comparer);
+			}
+		}
+
+		delete[] visited;
+		delete[] starts;
+	}
+
+	// Reverse Cuthill-McKee: keeps the ids of adjacent nodes within a narrow
+	// band.
+	template <class Graph>
+	void rcm_order(const Graph &g, typename Graph::node_t *order)
+	{
+		_search_order(g, order, true);
+		std::reverse(order, order + g.node_num());
+	}
+
+	// Breadth-first from the hubs: dense communities around a hub end up in
+	// consecutive ids.
+	template <class Graph>
+	void bfs_order(const Graph &g, typename Graph::node_t *order)
+	{
+		_search_order(g, order, false);
+	}
+
+	template <class Graph>
+	void make_order(const Graph &g, node_order method, typename Graph::node_t *order)
+	{
+		switch (method)
+		{
+		case node_order::degree:
+			degree_order(g, order);
+			break;
+		case node_order::rcm:
+			rcm_order(g, order);
+			break;
+		case node_order::bfs:
+			bfs_order(g, order);
+			break;
+		}
+	}
+
+	// rank[old id] = new id
+	template <class Node>
+	void inverse_order(const Node *order, Node node_num, Node *rank)
+	{
+		for (Node i = 0; i < node_num; ++i) rank[order[i]] = i;
+	}
+
+	// Builds the graph relabeled by order: node i of the result is node
+	// order[i] of g, with its attribute. The edge lists are renumbered in
+	// parallel, one node per update_node, and the result is built on the same
+	// number of threads. Edge attributes are not carried, and Graph must have
+	// node attributes: NodeAttr = void is not supported.
+	template <class Graph>
+	class relabel : public parallel_algo<Graph>
+	{
+	public:
+		relabel(Graph &g, const typename Graph::node_t *order, size_t thread_num) : parallel_algo(g, thread_num), _order(order)
+		{
+			Graph::node_t n = g.node_num();
+			_rank = new Graph::node_t[n];
+			inverse_order(order, n, _rank);
+
+			_offsets = new long long[n + 1];
+			_offsets[0] = 0;
+			for (Graph::node_t i = 0; i < n; ++i)
+			{
+				_offsets[i + 1] = _offsets[i] + g.out_degree(order[i]);
+			}
+
+			_sources = new Graph::node_t[g.edge_num()];
+			_dests = new Graph::node_t[g.edge_num()];
+			_attrs = new Graph::node_attr_t[n];
+		}
+
+		~relabel()
+		{
+			delete[] _rank;
+			delete[] _offsets;
+			delete[] _sources;
+			delete[] _dests;
+			delete[] _attrs;
+		}
+
+		void update_node(typename Graph::node_t node)
+		{
+			Graph::node_t old = _order[node];
+			long long k = _offsets[node];
+			for (auto v : _graph.out_neighbors(old))
+			{
+				_sources[k] = node;
+				_dests[k] = _rank[v];
+				++k;
+			}
+			_attrs[node] = _graph.node_attr(old);
+		}
+
+		Graph build()
+		{
+			update();
+			Graph result;
+			result.build(_graph.node_num(), _attrs, _graph.edge_num(), _sources, _dests, this->_thread_num);
+			return result;
+		}
+
+	protected:
+		const typename Graph::node_t *_order;
+		typename Graph::node_t *_rank;
+		long long *_offsets;
+		typename Graph::node_t *_sources, *_dests;
+		typename Graph::node_attr_t *_attrs;
+	};
+
+	template <class Graph>
+	Graph reorder(Graph &g, const typename Graph::node_t *order, size_t thread_num)
+	{
+		relabel<Graph> r(g, order, thread_num);
+		return r.build();
+	}
+}
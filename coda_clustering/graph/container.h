@@ -2,6 +2,10 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <new>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
 
 namespace graph
 {
@@ -233,4 +237,39 @@ namespace graph
 			return val;
 		}
 	};
+
+	// new T[count] on a cache line boundary. Plain new[] does not honour
+	// alignas(64) before C++17, which the per-thread slots padded against
+	// false sharing rely on.
+	template <class T> T *aligned_new(size_t count)
+	{
+		size_t bytes = count * sizeof(T) + (count == 0);
+		void *ptr;
+#ifdef _MSC_VER
+		ptr = _aligned_malloc(bytes, 64);
+#else
+		if (posix_memalign(&ptr, 64, bytes) != 0) ptr = NULL;
+#endif
+		if (ptr == NULL) throw std::bad_alloc();
+		T *data = (T *)ptr;
+		for (size_t i = 0; i < count; ++i)
+		{
+			new (data + i) T();
+		}
+		return data;
+	}
+
+	template <class T> void aligned_delete(T *data, size_t count)
+	{
+		if (data == NULL) return;
+		for (size_t i = 0; i < count; ++i)
+		{
+			data[i].~T();
+		}
+#ifdef _MSC_VER
+		_aligned_free(data);
+#else
+		free(data);
+#endif
+	}
 }
\ No newline at end of file
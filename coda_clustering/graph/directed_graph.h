@@ -2,6 +2,11 @@
 
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 #include "container.h"
 #include "stream.h"
@@ -509,8 +514,66 @@ namespace graph
 			return compress ? _load_compressed(istream) : _load_binary(istream);
 		}
 
+		// Builds the graph from the edges (out_first[k], in_first[k]). Every
+		// neighbour list comes out sorted, with the bi neighbours moved to its
+		// front. With random access iterators the build runs on thread_num
+		// threads; 0 takes one per _build_grain edges, at most one per core.
+		// The result is the same as that of the serial build.
 		template <class Node_InIt>
-		void build(Node node_num, long long edge_num, Node_InIt out_first, Node_InIt in_first)
+		void build(Node node_num, long long edge_num, Node_InIt out_first, Node_InIt in_first, size_t thread_num = 0)
+		{
+			if (thread_num == 0)
+			{
+				thread_num = (size_t)std::min((long long)std::thread::hardware_concurrency(), edge_num / _build_grain + 1);
+			}
+			bool is_random = std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<Node_InIt>::iterator_category>::value;
+			if (thread_num > 1 && is_random && _build_parallel(node_num, edge_num, out_first, in_first, thread_num)) return;
+			_build_serial(node_num, edge_num, out_first, in_first);
+		}
+
+		// Moves the offsets and edge lists to fresh arrays that the workers of
+		// executor, a parallel_algo over this graph, fill node by node. On a
+		// NUMA machine the pages of a node range then sit on the socket of the
+		// worker that processes it. Must not run concurrently with readers.
+		template <class Executor> void first_touch(Executor &executor)
+		{
+			long long *out_offsets = new long long[_node_num + 1];
+			long long *in_offsets = new long long[_node_num + 1];
+			Node *bi_degrees = new Node[_node_num];
+			Node *out_nbrs = new Node[_edge_num];
+			Node *in_nbrs = new Node[_edge_num];
+			executor.parallel_for(_node_num, [&](Node node, size_t thread)
+			{
+				out_offsets[node] = _out_offsets[node];
+				in_offsets[node] = _in_offsets[node];
+				bi_degrees[node] = _bi_degrees[node];
+				std::copy(_out_nbrs + _out_offsets[node], _out_nbrs + _out_offsets[node + 1], out_nbrs + _out_offsets[node]);
+				std::copy(_in_nbrs + _in_offsets[node], _in_nbrs + _in_offsets[node + 1], in_nbrs + _in_offsets[node]);
+			});
+			out_offsets[_node_num] = _edge_num;
+			in_offsets[_node_num] = _edge_num;
+
+			_delete(_out_offsets);
+			_delete(_in_offsets);
+			_delete(_bi_degrees);
+			_delete(_out_nbrs);
+			_delete(_in_nbrs);
+			_out_offsets = out_offsets;
+			_in_offsets = in_offsets;
+			_bi_degrees = bi_degrees;
+			_out_nbrs = out_nbrs;
+			_in_nbrs = in_nbrs;
+		}
+
+	protected:
+		Node _node_num;
+		long long _edge_num;
+		long long *_out_offsets, *_in_offsets;
+		Node *_bi_degrees;
+		Node *_out_nbrs, *_in_nbrs;
+
+		template <class Node_InIt>
+		void _build_serial(Node node_num, long long edge_num, Node_InIt out_first, Node_InIt in_first)
 		{
 			_release();
 			_alloc(node_num, edge_num);
@@ -617,12 +680,198 @@ namespace graph
 			delete[] tags;
 		}
 
-	protected:
-		Node _node_num;
-		long long _edge_num;
-		long long *_out_offsets, *_in_offsets;
-		Node *_bi_degrees;
-		Node *_out_nbrs, *_in_nbrs;
+		static const long long _build_grain = 1 << 20;
+		static const long long _build_block = 1024;
+		static const int _scatter_batch = 64;
+
+		template <class Func> static void _run_threads(size_t thread_num, const Func &fn)
+		{
+			std::thread *threads = new std::thread[thread_num];
+			for (size_t i = 0; i < thread_num; ++i)
+			{
+				threads[i] = std::thread(fn, i);
+			}
+			for (size_t i = 0; i < thread_num; ++i)
+			{
+				threads[i].join();
+			}
+			delete[] threads;
+		}
+
+		// Degrees are counted and edges scattered with atomic adds, so the
+		// lists come out in arbitrary order and are sorted node by node, which
+		// gives the lists of the serial build. Returns false if a node has
+		// more bi neighbours, counted on the out side, than in neighbours,
+		// which takes parallel edges; the serial build then writes the in list
+		// of that node into the next one, and is rerun to get the same result.
+		template <class Node_InIt>
+		bool _build_parallel(Node node_num, long long edge_num, Node_InIt out_first, Node_InIt in_first, size_t thread_num)
+		{
+			_release();
+			_alloc(node_num, edge_num);
+
+			std::atomic<long long> *out_counts = new std::atomic<long long>[node_num];
+			std::atomic<long long> *in_counts = new std::atomic<long long>[node_num];
+			long long *sums = new long long[thread_num * 2];
+			_run_threads(thread_num, [&](size_t thread)
+			{
+				Node first = (Node)((long long)node_num * thread / thread_num), last = (Node)((long long)node_num * (thread + 1) / thread_num);
+				for (Node i = first; i < last; ++i)
+				{
+					out_counts[i].store(0, std::memory_order_relaxed);
+					in_counts[i].store(0, std::memory_order_relaxed);
+				}
+			});
+
+			_run_threads(thread_num, [&](size_t thread)
+			{
+				long long first = edge_num * thread / thread_num, last = edge_num * (thread + 1) / thread_num;
+				Node_InIt out_it = out_first, in_it = in_first;
+				std::advance(out_it, first);
+				std::advance(in_it, first);
+				for (long long k = first; k < last; ++k, ++out_it, ++in_it)
+				{
+					out_counts[*out_it].fetch_add(1, std::memory_order_relaxed);
+					in_counts[*in_it].fetch_add(1, std::memory_order_relaxed);
+				}
+			});
+
+			_run_threads(thread_num, [&](size_t thread)
+			{
+				Node first = (Node)((long long)node_num * thread / thread_num), last = (Node)((long long)node_num * (thread + 1) / thread_num);
+				long long out_sum = 0, in_sum = 0;
+				for (Node i = first; i < last; ++i)
+				{
+					out_sum += out_counts[i].load(std::memory_order_relaxed);
+					in_sum += in_counts[i].load(std::memory_order_relaxed);
+				}
+				sums[thread * 2] = out_sum;
+				sums[thread * 2 + 1] = in_sum;
+			});
+			long long out_sum = 0, in_sum = 0;
+			for (size_t t = 0; t < thread_num; ++t)
+			{
+				long long out_next = out_sum + sums[t * 2], in_next = in_sum + sums[t * 2 + 1];
+				sums[t * 2] = out_sum;
+				sums[t * 2 + 1] = in_sum;
+				out_sum = out_next;
+				in_sum = in_next;
+			}
+
+			// Offsets are the starts of the lists; the counts become the
+			// scatter cursors.
+			_run_threads(thread_num, [&](size_t thread)
+			{
+				Node first = (Node)((long long)node_num * thread / thread_num), last = (Node)((long long)node_num * (thread + 1) / thread_num);
+				long long out_offset = sums[thread * 2], in_offset = sums[thread * 2 + 1];
+				for (Node i = first; i < last; ++i)
+				{
+					_out_offsets[i] = out_offset;
+					_in_offsets[i] = in_offset;
+					out_offset += out_counts[i].load(std::memory_order_relaxed);
+					in_offset += in_counts[i].load(std::memory_order_relaxed);
+					out_counts[i].store(_out_offsets[i], std::memory_order_relaxed);
+					in_counts[i].store(_in_offsets[i], std::memory_order_relaxed);
+				}
+			});
+			_out_offsets[node_num] = edge_num;
+			_in_offsets[node_num] = edge_num;
+
+			// A locked add waits for the stores before it, which mostly miss, so
+			// the slots of a batch of edges are taken before any is written.
+			_run_threads(thread_num, [&](size_t thread)
+			{
+				long long first = edge_num * thread / thread_num, last = edge_num * (thread + 1) / thread_num;
+				Node_InIt out_it = out_first, in_it = in_first;
+				std::advance(out_it, first);
+				std::advance(in_it, first);
+				Node nodes[_scatter_batch * 2];
+				long long slots[_scatter_batch * 2];
+				for (long long k = first; k < last; )
+				{
+					int batch = (int)std::min((long long)_scatter_batch, last - k);
+					for (int b = 0; b < batch; ++b, ++out_it, ++in_it)
+					{
+						Node i = *out_it, j = *in_it;
+						nodes[b * 2] = j;
+						nodes[b * 2 + 1] = i;
+						slots[b * 2] = out_counts[i].fetch_add(1, std::memory_order_relaxed);
+						slots[b * 2 + 1] = in_counts[j].fetch_add(1, std::memory_order_relaxed);
+					}
+					for (int b = 0; b < batch; ++b)
+					{
+						_out_nbrs[slots[b * 2]] = nodes[b * 2];
+						_in_nbrs[slots[b * 2 + 1]] = nodes[b * 2 + 1];
+					}
+					k += batch;
+				}
+			});
+			delete[] sums;
+			delete[] in_counts;
+			delete[] out_counts;
+
+			// Nodes are handed out in blocks, since hubs make the cost of equal
+			// node ranges uneven.
+			std::atomic<long long> next_node(0);
+			std::atomic<bool> is_overflow(false);
+			_run_threads(thread_num, [&](size_t thread)
+			{
+				std::vector<Node> out_buf, in_buf;
+				while (true)
+				{
+					long long first = next_node.fetch_add(_build_block);
+					if (first >= node_num) break;
+					long long last = std::min(first + _build_block, (long long)node_num);
+					for (long long i = first; i < last; ++i)
+					{
+						if (!_partition_node((Node)i, out_buf, in_buf)) is_overflow = true;
+					}
+				}
+			});
+			return !is_overflow;
+		}
+
+		// Sorts both lists of node and moves the bi neighbours to their front,
+		// in the order and multiplicity of the out list, as the tags of the
+		// serial build do; membership is found by merging the sorted lists.
+		bool _partition_node(Node node, std::vector<Node> &out_buf, std::vector<Node> &in_buf)
+		{
+			Node *out_first = _out_nbrs + _out_offsets[node], *out_last = _out_nbrs + _out_offsets[node + 1];
+			Node *in_first = _in_nbrs + _in_offsets[node], *in_last = _in_nbrs + _in_offsets[node + 1];
+			std::sort(out_first, out_last);
+			std::sort(in_first, in_last);
+
+			out_buf.clear();
+			const Node *p = in_first;
+			for (Node *it = out_first; it != out_last; ++it)
+			{
+				while (p != in_last && *p < *it) ++p;
+				if (p != in_last && *p == *it) out_buf.push_back(*it);
+			}
+			Node bi_degree = (Node)out_buf.size();
+			p = in_first;
+			for (Node *it = out_first; it != out_last; ++it)
+			{
+				while (p != in_last && *p < *it) ++p;
+				if (p == in_last || *p != *it) out_buf.push_back(*it);
+			}
+
+			in_buf.assign(out_buf.begin(), out_buf.begin() + bi_degree);
+			p = out_first;
+			for (Node *it = in_first; it != in_last; ++it)
+			{
+				while (p != out_last && *p < *it) ++p;
+				if (p == out_last || *p != *it) in_buf.push_back(*it);
+			}
+			if ((long long)in_buf.size() > in_last - in_first) return false;
+
+			// A shorter in list (again from parallel edges) leaves the sorted
+			// tail in place, as in the serial build.
+			_bi_degrees[node] = bi_degree;
+			std::copy(out_buf.begin(), out_buf.end(), out_first);
+			std::copy(in_buf.begin(), in_buf.end(), in_first);
+			return true;
+		}
 
 		template <class Pointer> inline void _delete(Pointer &ptr)
 		{
@@ -1353,13 +1602,15 @@ namespace graph
 			_node_attrs->load(node_first, node_first + node_num);
 		}
 
+		// thread_num as in _directed_graph_base3::build; pass it as a size_t,
+		// another integer type is taken for the edge attribute iterator.
 		template <class Node_InIt, class NodeAttr_InIt>
-		void build(Node node_num, NodeAttr_InIt node_first, long long edge_num, Node_InIt out_first, Node_InIt in_first)
+		void build(Node node_num, NodeAttr_InIt node_first, long long edge_num, Node_InIt out_first, Node_InIt in_first, size_t thread_num = 0)
 		{
 			_release();
 			_alloc(_node_num, _edge_num);
 
-			_directed_graph_base2::build(node_num, edge_num, out_first, in_first);
+			_directed_graph_base2::build(node_num, edge_num, out_first, in_first, thread_num);
 			_node_attrs->load(node_first, node_first + node_num);
 		}
 
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdlib>
+#include <thread>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace graph
+{
+	inline size_t cpu_count()
+	{
+		size_t count = std::thread::hardware_concurrency();
+		return count == 0 ? 1 : count;
+	}
+
+	// Binds thread to one logical CPU. Returns false where the platform
+	// refuses or has no way to do it; on Windows only the first 64 CPUs,
+	// the processor group of the process, can be named.
+	inline bool pin_thread(std::thread &thread, size_t cpu)
+	{
+#if defined(_WIN32)
+		if (cpu >= 64) return false;
+		return SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << cpu) != 0;
+#elif defined(__linux__)
+		if (cpu >= CPU_SETSIZE) return false;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+		return false;
+#endif
+	}
+
+	// Worker i of threads goes to CPU (first_cpu + i) % cpu_count(), so that
+	// consecutive workers, which own consecutive node ranges, fill one socket
+	// before the next. Returns the number of workers pinned.
+	inline size_t pin_threads(std::thread *threads, size_t thread_num, size_t first_cpu = 0)
+	{
+		size_t count = cpu_count(), pinned = 0;
+		for (size_t i = 0; i < thread_num; ++i)
+		{
+			if (pin_thread(threads[i], (first_cpu + i) % count)) ++pinned;
+		}
+		return pinned;
+	}
+}
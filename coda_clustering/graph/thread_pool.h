@@ -1,106 +1,280 @@
 #pragma once
 
 #include <cstdlib>
+#include <cstdint>
 #include <thread>
 #include <functional>
 #include <mutex>
 #include <condition_variable>
 #include <future>
+#include <memory>
+#include <atomic>
+#include <vector>
 #include <type_traits>
 
+#include "container.h"
+#include "thread_affinity.h"
+
 namespace graph
 {
+	// Bounded multi-producer multi-consumer queue. Every cell carries a
+	// sequence number that tells producers and consumers whose turn it is,
+	// so push and pop take one compare-exchange on the tail or head index
+	// and never lock.
+	class task_queue
+	{
+	public:
+		task_queue(size_t capacity)
+		{
+			size_t size = 2;
+			while (size < capacity) size <<= 1;
+			_mask = size - 1;
+			_cells = aligned_new<_cell>(size);
+			for (size_t i = 0; i < size; ++i)
+			{
+				_cells[i].sequence = i;
+			}
+			_head = 0;
+			_tail = 0;
+		}
+
+		~task_queue()
+		{
+			aligned_delete(_cells, _mask + 1);
+		}
+
+		// Moves task into the queue; false if the queue is full.
+		bool push(std::function<void()> &task)
+		{
+			size_t pos = _tail.load(std::memory_order_relaxed);
+			_cell *cell;
+			while (true)
+			{
+				cell = &_cells[pos & _mask];
+				size_t sequence = cell->sequence.load(std::memory_order_acquire);
+				intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+				if (diff == 0)
+				{
+					if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+				}
+				else if (diff < 0)
+				{
+					return false;
+				}
+				else
+				{
+					pos = _tail.load(std::memory_order_relaxed);
+				}
+			}
+			cell->task = std::move(task);
+			cell->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		// false if the queue is empty.
+		bool pop(std::function<void()> &task)
+		{
+			size_t pos = _head.load(std::memory_order_relaxed);
+			_cell *cell;
+			while (true)
+			{
+				cell = &_cells[pos & _mask];
+				size_t sequence = cell->sequence.load(std::memory_order_acquire);
+				intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+				if (diff == 0)
+				{
+					if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+				}
+				else if (diff < 0)
+				{
+					return false;
+				}
+				else
+				{
+					pos = _head.load(std::memory_order_relaxed);
+				}
+			}
+			task = std::move(cell->task);
+			cell->task = nullptr;
+			cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+			return true;
+		}
+
+	private:
+		struct alignas(64) _cell
+		{
+			std::atomic<size_t> sequence;
+			std::function<void()> task;
+		};
+
+		_cell *_cells;
+		size_t _mask;
+		alignas(64) std::atomic<size_t> _head;
+		alignas(64) std::atomic<size_t> _tail;
+	};
 
+	// Fixed set of workers fed by a task_queue of queue_size entries. A
+	// submitter that finds the queue full runs queued tasks itself until
+	// there is room, so submitting never oversubscribes the cores. Idle
+	// workers yield for a while before parking.
 	class thread_pool
 	{
 	public:
-		thread_pool(size_t thread_num)
+		thread_pool(size_t thread_num, size_t queue_size = 1024, bool pin_threads = false) : _queue(queue_size)
 		{
 			_thread_num = thread_num;
-			_is_destructed = false;
-			_tasks = new std::function<void()>[_thread_num];
-			_start_mutexes = new std::mutex[_thread_num];
-			_start_cvs = new std::condition_variable[_thread_num];
+			_is_exit = false;
+			_queued = 0;
+			_pending = 0;
+			_sleeping = 0;
 			_threads = new std::thread[_thread_num];
 			for (size_t i = 0; i < _thread_num; ++i)
 			{
-				_threads[i] = std::thread(&thread_pool::_thread_loop, this, i);
+				_threads[i] = std::thread(&thread_pool::_thread_loop, this);
 			}
+			if (pin_threads) this->pin_threads();
 		}
 
 		~thread_pool()
 		{
-			_is_destructed = true;
-			for (size_t i = 0; i < _thread_num; ++i)
+			wait_all();
 			{
-				std::unique_lock<std::mutex> lock(_start_mutexes[i]);
-				_start_cvs[i].notify_one();
+				std::unique_lock<std::mutex> lock(_mutex);
+				_is_exit = true;
+				_start_cv.notify_all();
 			}
 			for (size_t i = 0; i < _thread_num; ++i)
 			{
 				_threads[i].join();
 			}
-			delete[] _tasks;
-			delete[] _start_mutexes;
-			delete[] _start_cvs;
 			delete[] _threads;
 		}
 
+		size_t thread_num() const
+		{
+			return _thread_num;
+		}
+
+		// Binds worker i to CPU (first_cpu + i) % cpu_count(); returns the
+		// number of workers pinned.
+		size_t pin_threads(size_t first_cpu = 0)
+		{
+			return graph::pin_threads(_threads, _thread_num, first_cpu);
+		}
+
+		// Runs func(args...) on a worker; the future holds the result or the
+		// exception it threw.
 		template <class Func, class... Args>
-		void invoke(Func&& func, Args&&... args)
+		auto submit(Func &&func, Args&&... args) -> std::future<decltype(std::bind(std::forward<Func>(func), std::forward<Args>(args)...)())>
 		{
-			std::unique_lock<std::mutex> lock(_ready_mutex);
-			size_t id;
-			while (true)
+			typedef decltype(std::bind(std::forward<Func>(func), std::forward<Args>(args)...)()) Result;
+			auto task = std::make_shared<std::packaged_task<Result()>>(std::bind(std::forward<Func>(func), std::forward<Args>(args)...));
+			std::future<Result> result = task->get_future();
+			_push([task]() { (*task)(); });
+			_wake(1);
+			return result;
+		}
+
+		// Submits func(0), ..., func(count - 1) and wakes the workers once.
+		template <class Func>
+		auto submit_batch(size_t count, Func func) -> std::vector<std::future<decltype(func((size_t)0))>>
+		{
+			typedef decltype(func((size_t)0)) Result;
+			std::vector<std::future<Result>> results;
+			results.reserve(count);
+			for (size_t i = 0; i < count; ++i)
 			{
-				for (id = 0; id < _thread_num; ++id)
-				{
-					if (!_tasks[id]) break;
-				}
-				if (id < _thread_num) break;
-				_ready_cv.wait(lock);
+				auto task = std::make_shared<std::packaged_task<Result()>>(std::bind(func, i));
+				results.push_back(task->get_future());
+				_push([task]() { (*task)(); });
 			}
+			_wake(count);
+			return results;
+		}
 
+		// Fire and forget: runs func(args...) on a worker without a future.
+		template <class Func, class... Args>
+		void invoke(Func &&func, Args&&... args)
+		{
+			_push(std::bind(std::forward<Func>(func), std::forward<Args>(args)...));
+			_wake(1);
+		}
 
+		// Returns once every task submitted so far has finished, running
+		// queued tasks on the calling thread meanwhile. Must not be called
+		// from a task.
+		void wait_all()
+		{
+			while (_pending != 0)
 			{
-				std::unique_lock<std::mutex> lock(_start_mutexes[id]);
-				typedef typename std::result_of<Func(Args...)>::type Result;
-				_tasks[id] = std::bind(std::_Decay_copy(std::forward<Func>(func)), std::_Decay_copy(std::forward<Args>(args))...);
-				_start_cvs[id].notify_one();
+				if (_run_one()) continue;
+				for (int i = 0; i < _spin_num && _pending != 0 && _queued == 0; ++i) std::this_thread::yield();
+				if (_queued != 0) continue;
+				std::unique_lock<std::mutex> lock(_mutex);
+				while (_pending != 0 && _queued == 0) _done_cv.wait(lock);
 			}
-
 		}
 
 	private:
+		static const int _spin_num = 1024;
+
 		size_t _thread_num;
-		bool _is_destructed;
 		std::thread *_threads;
-		std::function<void()> *_tasks;
-		std::mutex *_start_mutexes;
-		std::mutex _ready_mutex;
-		std::condition_variable *_start_cvs;
-		std::condition_variable _ready_cv;
+		task_queue _queue;
+		// _queued counts tasks from the start of their push to their pop, so it
+		// is never below the number of tasks in the queue.
+		std::atomic<size_t> _queued, _pending, _sleeping;
+		std::atomic<bool> _is_exit;
+		std::mutex _mutex;
+		std::condition_variable _start_cv, _done_cv;
 
-		void _thread_loop(size_t id)
+		void _push(std::function<void()> task)
 		{
-			while (true)
+			++_pending;
+			++_queued;
+			while (!_queue.push(task))
 			{
-				{
-					std::unique_lock<std::mutex> lock(_start_mutexes[id]);
-					while (!_is_destructed && !_tasks[id]) _start_cvs[id].wait(lock);
-					if (!_tasks[id]) break;
-				}
+				if (!_run_one()) std::this_thread::yield();
+			}
+		}
 
-				_tasks[id]();
+		void _wake(size_t count)
+		{
+			if (_sleeping == 0) return;
+			std::unique_lock<std::mutex> lock(_mutex);
+			if (count == 1) _start_cv.notify_one();
+			else _start_cv.notify_all();
+		}
 
-				{
-					std::unique_lock<std::mutex> lock(_ready_mutex);
-					std::function<void()> empty;
-					empty.swap(_tasks[id]);
-					_ready_cv.notify_one();
-				}
+		bool _run_one()
+		{
+			std::function<void()> task;
+			if (!_queue.pop(task)) return false;
+			--_queued;
+			task();
+			if (--_pending == 0)
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_done_cv.notify_all();
+			}
+			return true;
+		}
+
+		void _thread_loop()
+		{
+			while (true)
+			{
+				if (_run_one()) continue;
+				for (int i = 0; i < _spin_num && _queued == 0 && !_is_exit; ++i) std::this_thread::yield();
+				if (_queued != 0) continue;
+
+				std::unique_lock<std::mutex> lock(_mutex);
+				++_sleeping;
+				while (_queued == 0 && !_is_exit) _start_cv.wait(lock);
+				--_sleeping;
+				if (_queued == 0 && _is_exit) return;
 			}
 		}
 	};
 
-}
\ No newline at end of file
+}
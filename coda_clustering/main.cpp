@@ -1,11 +1,14 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <direct.h>
 #include <thread>
+#include <chrono>
 #include <algorithm>
 #include <vector>
 
 #include "graph/graph.h"
+#include "graph/algorithm/reorder.h"
 #include "affi_directed_model.h"
 
 typedef graph::directed_graph<int, char *> graph_t;
@@ -27,13 +30,22 @@ template <class T> T** load_array2(const char *path, size_t num, size_t len)
 	return entry;
 }
 
-template <class T> void save_array2(const char *path, T **data, size_t num, size_t len)
+// With rank, the model was trained on a relabeled graph and row i of the file
+// is node rank[i] of the model.
+void save_affinity(const char *path, affi_directed_model &adm, bool is_out, const int *rank = nullptr)
 {
 	graph::file_ostream os(path);
-	for (size_t i = 0; i < num; ++i)
+	float *row = new float[adm.cluster_num()];
+	float *buf = affi_alloc(adm.row_size());
+	for (int i = 0; i < adm.node_num(); ++i)
 	{
-		os.write(data[i], len);
+		int node = rank == nullptr ? i : rank[i];
+		if (is_out) adm.affinity_out(node, row, buf);
+		else adm.affinity_in(node, row, buf);
+		os.write(row, adm.cluster_num());
 	}
+	affi_free(buf);
+	delete[] row;
 }
 
 void load_label_string(graph::directed_graph<int, char *> &g, char *label[], const char *path)
@@ -68,12 +80,109 @@ void train_and_save(int cluster_num, const char *graph_path, const char *affi_in
 	double improve = adm.converge(100.0f, 1e-3f, 0.5f, NULL, 1e-4f);
 	printf("Improve = %f\n", improve);
 
-	save_array2(affi_in_path, adm.affinity_in(), adm.node_num(), adm.cluster_num());
-	save_array2(affi_out_path, adm.affinity_out(), adm.node_num(), adm.cluster_num());
+	save_affinity(affi_in_path, adm, false);
+	save_affinity(affi_out_path, adm, true);
 }
 
+// Trains on a copy of the graph relabeled for locality; the affinity files are
+// written in the node order of the original graph.
+void train_and_save_reordered(int cluster_num, const char *graph_path, const char *affi_in_path, const char *affi_out_path, graph::node_order method)
+{
+	graph_t g;
+	g.load(graph::file_istream(graph_path));
+	printf("%d nodes, %lld edges\n", g.node_num(), g.edge_num());
+	int n = g.node_num();
+	int *order = new int[n];
+	int *rank = new int[n];
+	graph::make_order(g, method, order);
+	graph::inverse_order(order, n, rank);
+	graph_t h = graph::reorder(g, order, 32);
+	affi_directed_model adm(h, cluster_num, 32);
+	adm.init_min_neighborhood();
+
+	printf("initialized\n");
+
+	double improve = adm.converge(100.0f, 1e-3f, 0.5f, NULL, 1e-4f);
+	printf("Improve = %f\n", improve);
 
-int main()
+	save_affinity(affi_in_path, adm, false, rank);
+	save_affinity(affi_out_path, adm, true, rank);
+	delete[] order;
+	delete[] rank;
+}
+
+// Runs the same number of out/in line-search rounds from the same seeds with
+// each row storage type and reports time and final likelihood against fp32.
+void benchmark_storage(int cluster_num, const char *graph_path, int round_num)
 {
+	graph_t g;
+	g.load(graph::file_istream(graph_path));
+	printf("%d nodes, %lld edges\n", g.node_num(), g.edge_num());
+
+	const affi_storage storages[] = { affi_storage::fp32, affi_storage::bf16, affi_storage::fp16 };
+	const char *names[] = { "fp32", "bf16", "fp16" };
+	float base = 0.0f;
+	for (int s = 0; s < 3; ++s)
+	{
+		affi_directed_model adm(g, cluster_num, 32, false, storages[s]);
+		adm.init_min_neighborhood();
+
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < round_num; ++r)
+		{
+			adm.iterate_out(100.0f, 1e-3f, 0.5f);
+			adm.iterate_in(100.0f, 1e-3f, 0.5f);
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		float l = adm.likelihood();
+		if (s == 0) base = l;
+		printf("%s: %.3f s/round, %.2f M edges/s per round, likelihood = %f, rel diff = %+.3e\n",
+			names[s], seconds / round_num, g.edge_num() * round_num / seconds * 1e-6, l, (l - base) / base);
+	}
+}
+
+// Times out/in line-search rounds from the same seeds for a range of
+// neighbour-row prefetch distances; meant for large power-law graphs, whose
+// hub rows are read far apart from each other.
+void benchmark_prefetch(int cluster_num, const char *graph_path, int round_num)
+{
+	graph_t g;
+	g.load(graph::file_istream(graph_path));
+	printf("%d nodes, %lld edges\n", g.node_num(), g.edge_num());
+
+	const int distances[] = { 0, 2, 4, 8, 16 };
+	for (int distance : distances)
+	{
+		affi_directed_model adm(g, cluster_num, 32);
+		adm.set_prefetch_distance(distance);
+		adm.init_min_neighborhood();
+
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < round_num; ++r)
+		{
+			adm.iterate_out(100.0f, 1e-3f, 0.5f);
+			adm.iterate_in(100.0f, 1e-3f, 0.5f);
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		printf("distance %d: %.3f s/round, %.2f M edges/s per round, likelihood = %f\n",
+			distance, seconds / round_num, g.edge_num() * round_num / seconds * 1e-6, adm.likelihood());
+	}
+}
+
+
+// main -benchmark_storage <cluster_num> <graph_path> <round_num>
+// main -benchmark_prefetch <cluster_num> <graph_path> <round_num>
+int main(int argc, char *argv[])
+{
+	if (argc == 5 && strcmp(argv[1], "-benchmark_storage") == 0)
+	{
+		benchmark_storage(atoi(argv[2]), argv[3], atoi(argv[4]));
+	}
+	else if (argc == 5 && strcmp(argv[1], "-benchmark_prefetch") == 0)
+	{
+		benchmark_prefetch(atoi(argv[2]), argv[3], atoi(argv[4]));
+	}
 	return 0;
 }
\ No newline at end of file